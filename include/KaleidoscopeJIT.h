@@ -15,21 +15,74 @@
 
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
 #include <memory>
+#include <string>
 
 namespace llvm {
     namespace orc {
 
+        /// An ObjectCache that persists compiled objects on disk, keyed by a
+        /// hash of the module's IR. Recompiling an identical module (e.g. the
+        /// standard prelude on a fresh session) loads the cached object
+        /// instead of re-running instruction selection.
+        class KaleidoscopeObjectCache : public ObjectCache {
+            std::string CacheDir;
+
+            std::string getCachePath(const Module *M) {
+                std::string IR;
+                raw_string_ostream OS(IR);
+                OS << *M;
+                MD5 Hash;
+                Hash.update(OS.str());
+                MD5::MD5Result Result;
+                Hash.final(Result);
+                SmallString<128> Path(CacheDir);
+                sys::path::append(Path, Result.digest() + ".o");
+                return std::string(Path);
+            }
+
+        public:
+            KaleidoscopeObjectCache(std::string CacheDir)
+                    : CacheDir(std::move(CacheDir)) {
+                sys::fs::create_directories(this->CacheDir);
+            }
+
+            void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+                std::error_code EC;
+                raw_fd_ostream OS(getCachePath(M), EC, sys::fs::OF_None);
+                if (EC)
+                    return;
+                OS << Obj.getBuffer();
+            }
+
+            std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+                auto Buffer = MemoryBuffer::getFile(getCachePath(M));
+                if (!Buffer)
+                    return nullptr;
+                return std::move(*Buffer);
+            }
+        };
+
         class KaleidoscopeJIT {
         private:
             std::unique_ptr<ExecutionSession> ES;
@@ -40,20 +93,50 @@ namespace llvm {
             RTDyldObjectLinkingLayer ObjectLayer;
             IRCompileLayer CompileLayer;
 
+            // Lazy compilation: modules added through the CODLayer are only
+            // compiled to machine code when one of their functions is first
+            // called (calls go through lazy call-through stubs until then).
+            std::unique_ptr<LazyCallThroughManager> LCTM;
+            CompileOnDemandLayer CODLayer;
+
             JITDylib &MainJD;
 
+            // Holds re-optimized ("hot") versions of functions. Searched
+            // before MainJD, so anything compiled after a function goes hot
+            // binds to the optimized definition; code that already resolved
+            // the cold version keeps its existing address.
+            JITDylib &HotJD;
+
         public:
             KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                            JITTargetMachineBuilder JTMB, DataLayout DL)
+                            JITTargetMachineBuilder JTMB, DataLayout DL,
+                            ObjectCache *Cache = nullptr)
                     : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
                       ObjectLayer(*this->ES,
                                   []() { return std::make_unique<SectionMemoryManager>(); }),
                       CompileLayer(*this->ES, ObjectLayer,
-                                   std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-                      MainJD(this->ES->createBareJITDylib("<main>")) {
+                                   std::make_unique<ConcurrentIRCompiler>(JTMB, Cache)),
+                      LCTM(cantFail(createLocalLazyCallThroughManager(
+                              JTMB.getTargetTriple(), *this->ES, 0))),
+                      CODLayer(*this->ES, CompileLayer, *LCTM,
+                               createLocalIndirectStubsManagerBuilder(
+                                       JTMB.getTargetTriple())),
+                      MainJD(this->ES->createBareJITDylib("<main>")),
+                      HotJD(this->ES->createBareJITDylib("<hot>")) {
+                // Only compile the functions that are actually requested, not
+                // whole modules at once.
+                CODLayer.setPartitionFunction(CompileOnDemandLayer::compileRequested);
                 MainJD.addGenerator(
                         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
                                 DL.getGlobalPrefix())));
+                // Symbols referenced from newly added modules resolve against
+                // the hot dylib first, then fall back to the cold definitions.
+                MainJD.setLinkOrder(
+                        {{&HotJD, JITDylibLookupFlags::MatchExportedSymbolsOnly},
+                         {&MainJD, JITDylibLookupFlags::MatchAllSymbols}},
+                        /*LinkAgainstThisJITDylibFirst=*/false);
+                HotJD.addToLinkOrder(MainJD,
+                                     JITDylibLookupFlags::MatchAllSymbols);
                 if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
                     ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
                     ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
@@ -65,7 +148,7 @@ namespace llvm {
                     ES->reportError(std::move(Err));
             }
 
-            static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+            static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(ObjectCache *Cache = nullptr) {
                 auto EPC = SelfExecutorProcessControl::Create();
                 if (!EPC)
                     return EPC.takeError();
@@ -80,7 +163,7 @@ namespace llvm {
                     return DL.takeError();
 
                 return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                                         std::move(*DL));
+                                                         std::move(*DL), Cache);
             }
 
             const DataLayout &getDataLayout() const { return DL; }
@@ -88,13 +171,34 @@ namespace llvm {
             JITDylib &getMainJITDylib() { return MainJD; }
 
             Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+                if (!RT)
+                    RT = MainJD.getDefaultResourceTracker();
+                return CODLayer.add(RT, std::move(TSM));
+            }
+
+            /// Add a module that bypasses the lazy layer and is compiled
+            /// eagerly. Use this for run-once code (anonymous top-level
+            /// expressions): laziness buys nothing there, and eager modules
+            /// can be cleanly reclaimed through their ResourceTracker.
+            Error addEagerModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
                 if (!RT)
                     RT = MainJD.getDefaultResourceTracker();
                 return CompileLayer.add(RT, std::move(TSM));
             }
 
+            /// Add a re-optimized definition to the hot dylib. Compiled
+            /// eagerly: by the time a function is known to be hot, laziness
+            /// has nothing left to buy.
+            Error addHotModule(ThreadSafeModule TSM) {
+                return CompileLayer.add(HotJD.getDefaultResourceTracker(),
+                                        std::move(TSM));
+            }
+
             Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
-                return ES->lookup({&MainJD}, Mangle(Name.str()));
+                return ES->lookup(
+                        {{&HotJD, JITDylibLookupFlags::MatchExportedSymbolsOnly},
+                         {&MainJD, JITDylibLookupFlags::MatchAllSymbols}},
+                        Mangle(Name.str()));
             }
         };
 
@@ -1,40 +1,78 @@
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
 #include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include "include/KaleidoscopeJIT.h"
 #include <algorithm>
 #include <cassert>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace llvm;
 using namespace llvm::sys;
 
@@ -68,181 +106,558 @@ enum Token {
     token_var = -13
 };
 
-static std::string IdentifierStr; // Filled in if token_identifier
-static double NumVal; // Filled in if token_number
-
-// Tokenのenum値かASCIIを返却する
-static int getToken() {
-    static int LastChar = ' ';
-
-    // ホワイトスペースをスキップ
-    while (isspace(LastChar))
-        LastChar = getchar();
-
-    if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-        // 読み込めるだけ読み込んで識別子や特定のキーワード(def, etc...)があるか確認しあったら返却
-        IdentifierStr = LastChar;
-        while (isalnum((LastChar = getchar())))
-            IdentifierStr += LastChar;
-
-        if (IdentifierStr == "def")
-            return token_def;
-        if (IdentifierStr == "extern")
-            return token_extern;
-        if (IdentifierStr == "if")
-            return token_if;
-        if (IdentifierStr == "then")
-            return token_then;
-        if (IdentifierStr == "else")
-            return token_else;
-        if (IdentifierStr == "for")
-            return token_for;
-        if (IdentifierStr == "in")
-            return token_in;
-        if (IdentifierStr == "binary")
-            return token_binary;
-        if (IdentifierStr == "unary")
-            return token_unary;
-        if (IdentifierStr == "var")
-            return token_var;
-        return token_identifier;
-    }
-
-    if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-        std::string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while (isdigit(LastChar) || LastChar == '.');
-
-        NumVal = strtod(NumStr.c_str(), nullptr);
-        return token_number;
-    }
-
-    if (LastChar == '#') {
-        // 行の最後までコメントアウト
-        do {
-            LastChar = getchar();
-        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-
-        if (LastChar != EOF)
-            return getToken();
-    }
-
-    // EOFチェック
-    if (LastChar == EOF)
-        return token_eof;
-
-    // Otherwise, just return the character as its ascii value.
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
+// -jit指定時はオブジェクト出力の代わりにJITで逐次実行する
+static bool UseJIT = false;
+// 対話セッションかどうか(プロンプトとIRダンプは対話時のみ出す)
+static bool Interactive = true;
+// -time-traceでフェーズごとの階層タイマーを有効にし、Chromeトレース形式のJSONを出力する
+static bool TimeTraceEnabled = false;
+static const char *TimeTraceFile = "time-trace.json";
+
+// インターンされた識別子シンボル
+// 同じ綴りの識別子は常に同じポインタになるため、以降のマップはポインタ比較で済む
+using Symbol = const std::string *;
+
+// 識別子のインターン管理
+// 実体はStorageに保持し(アドレスは安定)、Tableで綴り->シンボルを引く
+// 全Lexerで共有するため、並列パース中の挿入はミューテックスで保護する
+class StringInterner {
+    std::mutex Lock;
+    std::unordered_map<std::string_view, Symbol> Table;
+    std::deque<std::string> Storage;
+public:
+    Symbol intern(std::string_view S) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        auto It = Table.find(S);
+        if (It != Table.end())
+            return It->second;
+        Storage.emplace_back(S);
+        Symbol Sym = &Storage.back();
+        Table.emplace(std::string_view(*Sym), Sym);
+        return Sym;
+    }
+};
+static StringInterner TheInterner;
+
+// コンパイル統計カウンタ
+// 常時有効の軽量カウンタ(緩和順序のアトミック加算のみ)で、-stats指定時に
+// プロセス終了時の一覧出力に使う。パーサースレッドからも加算されるためアトミック
+struct CompilerStats {
+    std::atomic<uint64_t> TokensLexed{0};
+    // ExprAST::ExprKind順のASTノード数(9 = ノード種別数)
+    std::atomic<uint64_t> ASTNodes[9] = {};
+    std::atomic<uint64_t> FunctionsCompiled{0};
+    std::atomic<uint64_t> IRInstructions{0};
+    std::atomic<uint64_t> IRBasicBlocks{0};
+    std::atomic<uint64_t> FunctionLookups{0};
+
+    void count(std::atomic<uint64_t> &Counter, uint64_t N = 1) {
+        Counter.fetch_add(N, std::memory_order_relaxed);
+    }
+};
+static CompilerStats TheStats;
+// -statsで終了時にTheStatsの一覧を出力する
+static bool StatsEnabled = false;
+
+// 文字分類テーブル
+// isspace/isalnumの呼び出しを1回のテーブル参照に置き換える
+enum CharClass: unsigned char {
+    cc_space = 1,
+    cc_alpha = 2,
+    cc_digit = 4,
+    // 識別子の2文字目以降にのみ使える('parallel_for'のようなランタイム名のため)
+    cc_under = 8,
+};
+
+static constexpr std::array<unsigned char, 256> BuildCharClassTable() {
+    std::array<unsigned char, 256> Table{};
+    for (unsigned char C: {' ', '\t', '\n', '\v', '\f', '\r'})
+        Table[C] = cc_space;
+    for (int C = '0'; C <= '9'; ++C)
+        Table[C] = cc_digit;
+    for (int C = 'A'; C <= 'Z'; ++C)
+        Table[C] = cc_alpha;
+    for (int C = 'a'; C <= 'z'; ++C)
+        Table[C] = cc_alpha;
+    Table['_'] = cc_under;
+    return Table;
+}
+static constexpr std::array<unsigned char, 256> CharClassTable = BuildCharClassTable();
+
+// EOF(-1)も受け取れる分類ヘルパー
+static bool isSpaceChar(int C) { return C >= 0 && (CharClassTable[C] & cc_space); }
+static bool isAlphaChar(int C) { return C >= 0 && (CharClassTable[C] & cc_alpha); }
+static bool isAlnumChar(int C) { return C >= 0 && (CharClassTable[C] & (cc_alpha | cc_digit | cc_under)); }
+static bool isDigitChar(int C) { return C >= 0 && (CharClassTable[C] & cc_digit); }
+
+#ifdef __SSE2__
+// [Ptr, End)の先頭から連続するホワイトスペース(' ', '\t', '\n', '\r')を16バイト単位でスキップする
+// \v/\fなど稀な文字で止まった場合は呼び出し側のスカラーループが処理を引き継ぐ
+static const char *SkipWhitespaceSIMD(const char *Ptr, const char *End) {
+    const __m128i Space = _mm_set1_epi8(' ');
+    const __m128i Tab = _mm_set1_epi8('\t');
+    const __m128i LF = _mm_set1_epi8('\n');
+    const __m128i CR = _mm_set1_epi8('\r');
+    while (End - Ptr >= 16) {
+        __m128i Chunk = _mm_loadu_si128((const __m128i *)Ptr);
+        __m128i IsWS = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(Chunk, Space), _mm_cmpeq_epi8(Chunk, Tab)),
+            _mm_or_si128(_mm_cmpeq_epi8(Chunk, LF), _mm_cmpeq_epi8(Chunk, CR)));
+        // 非ホワイトスペースの位置をビットマスクで取得
+        int Mask = _mm_movemask_epi8(IsWS) ^ 0xFFFF;
+        if (Mask)
+            return Ptr + __builtin_ctz(Mask);
+        Ptr += 16;
+    }
+    return Ptr;
+}
+
+// [Ptr, End)の先頭から連続する識別子文字([0-9A-Za-z_])を16バイト単位でスキップする
+static const char *SkipAlnumSIMD(const char *Ptr, const char *End) {
+    // ASCIIのみ対象なので符号付き比較で問題ない(0x80以上は負になり非英数字扱いになる)
+    const __m128i DigitLo = _mm_set1_epi8('0' - 1), DigitHi = _mm_set1_epi8('9' + 1);
+    const __m128i UpperLo = _mm_set1_epi8('A' - 1), UpperHi = _mm_set1_epi8('Z' + 1);
+    const __m128i LowerLo = _mm_set1_epi8('a' - 1), LowerHi = _mm_set1_epi8('z' + 1);
+    const __m128i Under = _mm_set1_epi8('_');
+    while (End - Ptr >= 16) {
+        __m128i Chunk = _mm_loadu_si128((const __m128i *)Ptr);
+        __m128i IsDigit = _mm_and_si128(_mm_cmpgt_epi8(Chunk, DigitLo), _mm_cmplt_epi8(Chunk, DigitHi));
+        __m128i IsUpper = _mm_and_si128(_mm_cmpgt_epi8(Chunk, UpperLo), _mm_cmplt_epi8(Chunk, UpperHi));
+        __m128i IsLower = _mm_and_si128(_mm_cmpgt_epi8(Chunk, LowerLo), _mm_cmplt_epi8(Chunk, LowerHi));
+        __m128i IsAlnum = _mm_or_si128(_mm_or_si128(IsDigit, _mm_cmpeq_epi8(Chunk, Under)),
+                                       _mm_or_si128(IsUpper, IsLower));
+        int Mask = _mm_movemask_epi8(IsAlnum) ^ 0xFFFF;
+        if (Mask)
+            return Ptr + __builtin_ctz(Mask);
+        Ptr += 16;
+    }
+    return Ptr;
+}
+#endif
+
+// キーワード判定
+// 10本のstd::string比較チェーンの代わりに、長さで分岐してからmemcmp1回で確定させる
+static int KeywordToken(std::string_view S) {
+    switch (S.size()) {
+        case 2:
+            if (S == "if") return token_if;
+            if (S == "in") return token_in;
+            break;
+        case 3:
+            if (S == "def") return token_def;
+            if (S == "for") return token_for;
+            if (S == "var") return token_var;
+            break;
+        case 4:
+            if (S == "then") return token_then;
+            if (S == "else") return token_else;
+            break;
+        case 5:
+            if (S == "unary") return token_unary;
+            break;
+        case 6:
+            if (S == "extern") return token_extern;
+            if (S == "binary") return token_binary;
+            break;
+        default:
+            break;
+    }
+    return token_identifier;
 }
 
+// レキサー
+// 入力バッファ、先読み文字、現在のトークンの値をすべてインスタンスに持つ
+// グローバル状態を参照しないため、ファイルごとに独立したLexerを別スレッドで回せる
+class Lexer {
+    // バッファリングされた入力
+    // 対話モード以外ではソース全体を一括で読み込み、生ポインタでスキャンする
+    // getchar()の1バイトごとの呼び出しコストを避けるため(progs/のような大きな入力で効く)
+    std::string SourceBuffer;
+    const char *SourcePtr = nullptr;
+    const char *SourceEnd = nullptr;
+    bool BufferedInput = false;
+    // 対話モード用: string_viewの実体を保持するバッファ
+    std::string IdentifierScratch;
+    // レキサーの先読み文字
+    int LastChar = ' ';
+
+    // 1文字読み進める(バッファモードではポインタを進めるだけ)
+    int readChar() {
+        if (BufferedInput)
+            return SourcePtr == SourceEnd ? EOF : (unsigned char)*SourcePtr++;
+        return getchar();
+    }
+
+public:
+    std::string_view IdentifierStr; // token_identifierの際の綴り
+    Symbol IdentifierSym = nullptr; // token_identifierの際にインターン済みシンボルが入る
+    double NumVal = 0; // token_numberの際の数値
+
+    // ソース全体をSourceBufferへ一括読み込みし、バッファモードを有効にする
+    void slurp(FILE *In) {
+        char Chunk[1 << 16];
+        size_t N;
+        while ((N = fread(Chunk, 1, sizeof(Chunk), In)) > 0)
+            SourceBuffer.append(Chunk, N);
+        SourcePtr = SourceBuffer.data();
+        SourceEnd = SourceBuffer.data() + SourceBuffer.size();
+        BufferedInput = true;
+    }
+
+    // メモリ上のソースをそのまま入力にする(ベンチマーク用)
+    void setSource(std::string Source) {
+        SourceBuffer = std::move(Source);
+        SourcePtr = SourceBuffer.data();
+        SourceEnd = SourceBuffer.data() + SourceBuffer.size();
+        BufferedInput = true;
+    }
+
+    // 指定されたファイルをバッファへ読み込む(バッチモード用)
+    bool loadFile(const char *Path) {
+        FILE *In = fopen(Path, "rb");
+        if (!In) {
+            fprintf(stderr, "Error: cannot open '%s'\n", Path);
+            return false;
+        }
+        SourceBuffer.clear();
+        slurp(In);
+        fclose(In);
+        return true;
+    }
+
+    // Tokenのenum値かASCIIを返却する
+    int getToken() {
+
+        // ホワイトスペースをスキップ
+        while (isSpaceChar(LastChar)) {
+#ifdef __SSE2__
+            if (BufferedInput)
+                SourcePtr = SkipWhitespaceSIMD(SourcePtr, SourceEnd);
+#endif
+            LastChar = readChar();
+        }
+
+        if (isAlphaChar(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9_]*
+            // 読み込めるだけ読み込んで識別子や特定のキーワード(def, etc...)があるか確認しあったら返却
+            if (BufferedInput) {
+                // LastCharはすでに消費済みなので識別子の先頭はSourcePtr-1
+                const char *Start = SourcePtr - 1;
+#ifdef __SSE2__
+                SourcePtr = SkipAlnumSIMD(SourcePtr, SourceEnd);
+#endif
+                while (SourcePtr != SourceEnd && isAlnumChar((unsigned char)*SourcePtr))
+                    ++SourcePtr;
+                IdentifierStr = std::string_view(Start, SourcePtr - Start);
+                LastChar = readChar();
+            } else {
+                IdentifierScratch = (char)LastChar;
+                while (isAlnumChar((LastChar = readChar())))
+                    IdentifierScratch += (char)LastChar;
+                IdentifierStr = IdentifierScratch;
+            }
+
+            int Tok = KeywordToken(IdentifierStr);
+            if (Tok == token_identifier)
+                IdentifierSym = TheInterner.intern(IdentifierStr);
+            return Tok;
+        }
+
+        if (isDigitChar(LastChar) || LastChar == '.') { // Number: [0-9.]+
+            std::string NumStr;
+            do {
+                NumStr += LastChar;
+                LastChar = readChar();
+            } while (isDigitChar(LastChar) || LastChar == '.');
+
+            NumVal = strtod(NumStr.c_str(), nullptr);
+            return token_number;
+        }
+
+        if (LastChar == '#') {
+            // 行の最後までコメントアウト
+            do {
+                LastChar = readChar();
+            } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+
+            if (LastChar != EOF)
+                return getToken();
+        }
+
+        // EOFチェック
+        if (LastChar == EOF)
+            return token_eof;
+
+        // Otherwise, just return the character as its ascii value.
+        int ThisChar = LastChar;
+        LastChar = readChar();
+        return ThisChar;
+    }
+};
+
 //===----------------------------------------------------------------------===//
 // Abstract Syntax Tree (aka Parse Tree)
 //===----------------------------------------------------------------------===//
 
 // 式、プロトタイプ、関数オブジェクトが存在する
 namespace {
+    // ASTノード用のアリーナ(バンプ)アロケータ
+    // 1コンパイル単位のノードをまとめて所有し、reset()でブロックごと一括解放する
+    // make_uniqueによる個別のヒープ確保と再帰的なデストラクタ連鎖を避け、ノードの局所性も上げる
+    class ASTArena {
+        static constexpr size_t BlockSize = 1 << 16;
+        std::vector<std::unique_ptr<char[]>> Blocks;
+        char *Cur = nullptr;
+        char *End = nullptr;
+        // 非トリビアルなメンバ(std::string等)を持つノードだけデストラクタを登録する
+        std::vector<std::pair<void *, void (*)(void *)>> Dtors;
+
+        void *allocate(size_t Size, size_t Align) {
+            Cur = (char *)(((uintptr_t)Cur + Align - 1) & ~(uintptr_t)(Align - 1));
+            if ((size_t)(End - Cur) < Size) {
+                size_t N = std::max(BlockSize, Size + Align);
+                Blocks.push_back(std::make_unique<char[]>(N));
+                Cur = Blocks.back().get();
+                End = Cur + N;
+                Cur = (char *)(((uintptr_t)Cur + Align - 1) & ~(uintptr_t)(Align - 1));
+            }
+            void *Mem = Cur;
+            Cur += Size;
+            return Mem;
+        }
+
+    public:
+        template <typename T, typename... ArgTs>
+        T *create(ArgTs &&...Args) {
+            T *Node = new (allocate(sizeof(T), alignof(T))) T(std::forward<ArgTs>(Args)...);
+            if constexpr (!std::is_trivially_destructible_v<T>)
+                Dtors.emplace_back(Node, [](void *P) { static_cast<T *>(P)->~T(); });
+            return Node;
+        }
+
+        void reset() {
+            for (auto &D: Dtors)
+                D.second(D.first);
+            Dtors.clear();
+            Blocks.clear();
+            Cur = End = nullptr;
+        }
+    };
+
     // 式
+    // ノードはASTArenaが所有するため個別にdeleteしない(仮想デストラクタも持たない)
     class ExprAST {
     public:
-        virtual ~ExprAST() = default;
+        // ノード種別(RTTI無しでのダウンキャストや畳み込み判定に使う)
+        enum ExprKind {
+            ek_number,
+            ek_variable,
+            ek_binary,
+            ek_unary,
+            ek_call,
+            ek_if,
+            ek_for,
+            ek_var,
+            ek_index,
+        };
+    private:
+        const ExprKind Kind;
+    public:
+        ExprAST(ExprKind Kind): Kind(Kind) { TheStats.count(TheStats.ASTNodes[Kind]); }
+        ExprKind getKind() const { return Kind; }
         // 該当のASTノードのIRを、依存するすべてのものと一緒に返却する
         // Valueは、LLVMで"Static Single Assignment (SSA) register"または"SSA value"を表すために使われるクラス
         // SSAはその値が関連する命令の実行時に計算され、イミュータブルである(参考: https://llvm.org/docs/tutorial/MyFirstLanguageFrontend/LangImpl03.html)
         virtual Value *codegen() = 0;
+        // 定数畳み込み。畳み込めた場合は置き換え後のノードを返す(デフォルトはそのまま)
+        virtual ExprAST *fold() { return this; }
+        // '='で代入される変数名を集める(allocaが必要な変数の事前解析に使う)
+        virtual void collectAssignedVars(std::unordered_set<Symbol> &Assigned) const {}
     };
 
     // 数値リテラル
     class NumberExprAST: public ExprAST {
         double Val; // 数値
     public:
-        NumberExprAST(double Val): Val(Val) {}
+        NumberExprAST(double Val): ExprAST(ek_number), Val(Val) {}
         Value *codegen() override;
+        double getVal() const { return Val; }
+        static bool classof(const ExprAST *E) { return E->getKind() == ek_number; }
     };
 
     // 変数
     class VariableExprAST: public ExprAST {
-        std::string Name; // 変数名
+        Symbol Name; // 変数名
     public:
-        VariableExprAST(const std::string &Name): Name(Name) {}
+        VariableExprAST(Symbol Name): ExprAST(ek_variable), Name(Name) {}
         Value *codegen() override;
-        const std::string &getName() const { return Name; }
+        Symbol getName() const { return Name; }
+        static bool classof(const ExprAST *E) { return E->getKind() == ek_variable; }
+    };
+
+    // 配列要素参照(name[index])
+    // 読みならGEP+load、'='の左辺ならGEP+storeになる
+    class IndexExprAST: public ExprAST {
+        Symbol ArrayName; // 配列名
+        ExprAST *Index; // 要素番号(doubleをi64へ切り捨てて使う)
+    public:
+        IndexExprAST(Symbol ArrayName, ExprAST *Index): ExprAST(ek_index), ArrayName(ArrayName), Index(Index) {}
+        Value *codegen() override;
+        ExprAST *fold() override;
+        Symbol getArrayName() const { return ArrayName; }
+        ExprAST *getIndex() const { return Index; }
+        void collectAssignedVars(std::unordered_set<Symbol> &Assigned) const override { Index->collectAssignedVars(Assigned); }
+        static bool classof(const ExprAST *E) { return E->getKind() == ek_index; }
     };
 
     // 二項演算子(binary operator)
     class BinaryExprAST: public ExprAST {
         char Op; // オペコード(例: '+')
-        std::unique_ptr<ExprAST> LHS, RHS;
+        ExprAST *LHS, *RHS;
     public:
-        BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS): Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+        BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS): ExprAST(ek_binary), Op(Op), LHS(LHS), RHS(RHS) {}
+        char getOp() const { return Op; }
+        ExprAST *getLHS() const { return LHS; }
+        ExprAST *getRHS() const { return RHS; }
         Value *codegen() override;
+        ExprAST *fold() override;
+        void collectAssignedVars(std::unordered_set<Symbol> &Assigned) const override;
+        static bool classof(const ExprAST *E) { return E->getKind() == ek_binary; }
     };
 
     // 単項演算子(unary operator)
     class UnaryExprAST: public ExprAST {
         char Opcode;
-        std::unique_ptr<ExprAST> Operand;
+        ExprAST *Operand;
     public:
-        UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand): Opcode(Opcode), Operand(std::move(Operand)) {}
+        UnaryExprAST(char Opcode, ExprAST *Operand): ExprAST(ek_unary), Opcode(Opcode), Operand(Operand) {}
+        char getOpcode() const { return Opcode; }
+        ExprAST *getOperand() const { return Operand; }
         Value *codegen() override;
+        ExprAST *fold() override;
+        void collectAssignedVars(std::unordered_set<Symbol> &Assigned) const override { Operand->collectAssignedVars(Assigned); }
+        static bool classof(const ExprAST *E) { return E->getKind() == ek_unary; }
     };
 
     // 関数呼び出し
     class CallExprAST: public ExprAST {
-        std::string Callee; // 関数名
-        std::vector<std::unique_ptr<ExprAST>> Args; // 引数式
+        Symbol Callee; // 関数名
+        std::vector<ExprAST *> Args; // 引数式
     public:
-        CallExprAST(const std::string &Callee, std::vector<std::unique_ptr<ExprAST>> Args): Callee(Callee), Args(std::move(Args)) {}
+        CallExprAST(Symbol Callee, std::vector<ExprAST *> Args): ExprAST(ek_call), Callee(Callee), Args(std::move(Args)) {}
+        Symbol getCallee() const { return Callee; }
+        const std::vector<ExprAST *> &getArgs() const { return Args; }
         Value *codegen() override;
+        ExprAST *fold() override;
+        void collectAssignedVars(std::unordered_set<Symbol> &Assigned) const override {
+            for (const auto *Arg: Args)
+                Arg->collectAssignedVars(Assigned);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == ek_call; }
     };
 
     // if
     class IfExprAST: public ExprAST {
-        std::unique_ptr<ExprAST> Condition, Then, Else;
+        ExprAST *Condition, *Then, *Else;
     public:
-        IfExprAST(std::unique_ptr<ExprAST> Condition, std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else): Condition(std::move(Condition)), Then(std::move(Then)), Else(std::move(Else)) {}
+        IfExprAST(ExprAST *Condition, ExprAST *Then, ExprAST *Else): ExprAST(ek_if), Condition(Condition), Then(Then), Else(Else) {}
+        ExprAST *getCondition() const { return Condition; }
+        ExprAST *getThen() const { return Then; }
+        ExprAST *getElse() const { return Else; }
         Value *codegen() override;
+        ExprAST *fold() override;
+        void collectAssignedVars(std::unordered_set<Symbol> &Assigned) const override {
+            Condition->collectAssignedVars(Assigned);
+            Then->collectAssignedVars(Assigned);
+            Else->collectAssignedVars(Assigned);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == ek_if; }
     };
 
     // for
     class ForExprAST: public ExprAST {
-        std::string VarName;
-        std::unique_ptr<ExprAST> Start, End, Step, Body;
+        Symbol VarName;
+        ExprAST *Start, *End, *Step, *Body;
     public:
-        ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)), End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
+        ForExprAST(Symbol VarName, ExprAST *Start, ExprAST *End, ExprAST *Step, ExprAST *Body)
+        : ExprAST(ek_for), VarName(VarName), Start(Start), End(End), Step(Step), Body(Body) {}
+        Symbol getVarName() const { return VarName; }
+        ExprAST *getStart() const { return Start; }
+        ExprAST *getEnd() const { return End; }
+        ExprAST *getStep() const { return Step; }
+        ExprAST *getBody() const { return Body; }
         Value *codegen() override;
+        ExprAST *fold() override;
+        void collectAssignedVars(std::unordered_set<Symbol> &Assigned) const override {
+            Start->collectAssignedVars(Assigned);
+            End->collectAssignedVars(Assigned);
+            if (Step)
+                Step->collectAssignedVars(Assigned);
+            Body->collectAssignedVars(Assigned);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == ek_for; }
     };
 
     // var
     class VarExprAST: public ExprAST {
-        std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-        std::unique_ptr<ExprAST> Body;
     public:
-        VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames, std::unique_ptr<ExprAST> Body): VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+        // 1つの束縛。Sizeが非nullなら連続したdoubleバッファの配列宣言(var a[N] in ...)
+        struct VarDecl {
+            Symbol Name;
+            ExprAST *Init; // スカラーの初期値(省略時は0.0)
+            ExprAST *Size; // 配列の要素数(スカラー変数ならnull)
+        };
+    private:
+        std::vector<VarDecl> VarNames;
+        ExprAST *Body;
+    public:
+        VarExprAST(std::vector<VarDecl> VarNames, ExprAST *Body): ExprAST(ek_var), VarNames(std::move(VarNames)), Body(Body) {}
+        const std::vector<VarDecl> &getVarNames() const { return VarNames; }
+        ExprAST *getBody() const { return Body; }
         Value *codegen() override;
+        ExprAST *fold() override;
+        void collectAssignedVars(std::unordered_set<Symbol> &Assigned) const override {
+            for (const auto &D: VarNames) {
+                if (D.Init)
+                    D.Init->collectAssignedVars(Assigned);
+                if (D.Size)
+                    D.Size->collectAssignedVars(Assigned);
+            }
+            Body->collectAssignedVars(Assigned);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == ek_var; }
     };
 
     // 関数のプロトタイプ(インターフェース)
     class PrototypeAST {
-        std::string Name; // 関数名
-        std::vector<std::string> Args; // 引数名
+        Symbol Name; // 関数名
+        std::vector<Symbol> Args; // 引数名
         bool IsOperator;
         unsigned Precedence; // Precedence if a binary operator
+        // externで宣言されたか(呼び出し規約の決定に使う。定義される関数はfastccにできるが、
+        // externはホスト側のC関数なのでC呼び出し規約のまま呼ぶ必要がある)
+        bool IsExtern = false;
     public:
-        PrototypeAST(const std::string &Name, std::vector<std::string> Args, bool IsOperator = false, unsigned Precedence = 0): Name(Name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Precedence) {}
+        // 引数の渡し方('a[]'はdouble*の配列、'v<>'は<4 x double>のSIMDベクトル)
+        // ArgKindsが空ならすべてスカラー
+        enum ArgKind: char { ak_scalar, ak_array, ak_vector };
+    private:
+        std::vector<ArgKind> ArgKinds;
+    public:
+        PrototypeAST(Symbol Name, std::vector<Symbol> Args, bool IsOperator = false, unsigned Precedence = 0, std::vector<ArgKind> ArgKinds = {}): Name(Name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Precedence), ArgKinds(std::move(ArgKinds)) {}
         Function *codegen();
-        const std::string &getName() const { return Name; }
+        Symbol getName() const { return Name; }
+        const std::vector<Symbol> &getArgs() const { return Args; }
+        ArgKind getArgKind(unsigned Idx) const { return Idx < ArgKinds.size() ? ArgKinds[Idx] : ak_scalar; }
+
+        void markExtern() { IsExtern = true; }
+        bool isExtern() const { return IsExtern; }
 
         bool isUnaryOperator() const { return IsOperator && Args.size() == 1; }
         bool isBinaryOperator() const { return IsOperator && Args.size() == 2; }
 
         char getOperatorName() const {
             assert(isUnaryOperator() || isBinaryOperator());
-            return Name[Name.size() - 1];
+            return (*Name)[Name->size() - 1];
         }
 
         unsigned getBinaryPrecedence() const { return Precedence; }
@@ -251,40 +666,121 @@ namespace {
     // 関数
     class FunctionAST {
         std::unique_ptr<PrototypeAST> Proto;
-        std::unique_ptr<ExprAST> Body;
+        ExprAST *Body;
     public:
-        FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body): Proto(std::move(Proto)), Body(std::move(Body)) {}
+        FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body): Proto(std::move(Proto)), Body(Body) {}
         Function *codegen();
+        Symbol getProtoName() const { return Proto->getName(); }
+        const PrototypeAST &getProto() const { return *Proto; }
+        ExprAST *getBody() const { return Body; }
     };
 }
 
+// 1コンパイル単位(トップレベルの定義/式)のASTノードを所有するアリーナ
+// 各Handle*がcodegen完了後にresetする
+static ASTArena TheASTArena;
+
 //===----------------------------------------------------------------------===//
-// Parser
+// Constant Folding
 //===----------------------------------------------------------------------===//
 
-// パーサーが現在見ているトークン
-static int CurrentToken;
-// レキサーから別のトークンを読み込み、CurrentTokenを更新する
-static int getNextToken() {
-    return CurrentToken = getToken();
+// コード生成前のAST上の定数畳み込みステージ
+// リテラル同士の演算や条件が定数のifをIRを作る前に潰しておくことで、
+// 生成するIRの量とInstCombine以降の最適化時間を減らす
+
+ExprAST *BinaryExprAST::fold() {
+    // '='の左辺は変数参照のまま残す必要がある
+    if (Op != '=')
+        LHS = LHS->fold();
+    RHS = RHS->fold();
+
+    auto *L = dyn_cast<NumberExprAST>(LHS);
+    auto *R = dyn_cast<NumberExprAST>(RHS);
+    if (!L || !R)
+        return this;
+
+    // 組み込み演算子のみ畳み込む(ユーザー定義演算子は実行時の定義に従う)
+    switch (Op) {
+        case '+':
+            return TheASTArena.create<NumberExprAST>(L->getVal() + R->getVal());
+        case '-':
+            return TheASTArena.create<NumberExprAST>(L->getVal() - R->getVal());
+        case '*':
+            return TheASTArena.create<NumberExprAST>(L->getVal() * R->getVal());
+        case '<':
+            return TheASTArena.create<NumberExprAST>(L->getVal() < R->getVal() ? 1.0 : 0.0);
+        default:
+            return this;
+    }
 }
 
-// 二項演算子の優先順位
-static std::map<char, int> BinaryOperatorPrecedence;
+void BinaryExprAST::collectAssignedVars(std::unordered_set<Symbol> &Assigned) const {
+    if (Op == '=')
+        if (const auto *LHSE = dyn_cast<VariableExprAST>(LHS))
+            Assigned.insert(LHSE->getName());
+    LHS->collectAssignedVars(Assigned);
+    RHS->collectAssignedVars(Assigned);
+}
 
-// 現在のトークンの優先順位が返却される
-// 二項演算子でない場合は-1が返却される
-static int GetTokenPrecedence() {
-    if (!isascii(CurrentToken))
-        return -1;
+ExprAST *IndexExprAST::fold() {
+    Index = Index->fold();
+    return this;
+}
 
-    int TokenPrecedence = BinaryOperatorPrecedence[CurrentToken];
-    if (TokenPrecedence <= 0)
-        return -1;
-    return TokenPrecedence;
+ExprAST *UnaryExprAST::fold() {
+    Operand = Operand->fold();
+    return this;
+}
+
+ExprAST *CallExprAST::fold() {
+    for (auto &Arg: Args)
+        Arg = Arg->fold();
+    return this;
+}
+
+ExprAST *IfExprAST::fold() {
+    Condition = Condition->fold();
+    Then = Then->fold();
+    Else = Else->fold();
+
+    // 条件が定数なら選ばれる側の枝だけを残す(0.0以外が真)
+    if (auto *C = dyn_cast<NumberExprAST>(Condition))
+        return C->getVal() != 0.0 ? Then : Else;
+    return this;
 }
 
-std::unique_ptr<ExprAST> LogError(const char *Str) {
+ExprAST *ForExprAST::fold() {
+    // Kaleidoscopeのforは本体を最低1回実行してから終了条件を見るため、
+    // トリップ回数0のループというものは存在しない。子の畳み込みのみ行う
+    Start = Start->fold();
+    End = End->fold();
+    if (Step)
+        Step = Step->fold();
+    Body = Body->fold();
+    return this;
+}
+
+ExprAST *VarExprAST::fold() {
+    for (auto &D: VarNames) {
+        if (D.Init)
+            D.Init = D.Init->fold();
+        if (D.Size)
+            D.Size = D.Size->fold();
+    }
+    Body = Body->fold();
+    return this;
+}
+
+//===----------------------------------------------------------------------===//
+// Parser
+//===----------------------------------------------------------------------===//
+
+// 報告済みエラーの通し番号(ASTキャッシュがエラーのあったファイルを
+// 書き出さないための判定に使う。並列パース中も数え落とさないようatomic)
+static std::atomic<unsigned> ErrorsReported{0};
+
+ExprAST *LogError(const char *Str) {
+    ++ErrorsReported;
     fprintf(stderr, "Error: %s\n", Str);
     return nullptr;
 }
@@ -294,21 +790,105 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
     return nullptr;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+// プレリュード(-prelude=)から復元したユーザー定義二項演算子の優先順位
+// 優先順位は構文情報でIRに残らないため、ビットコード内の名前付きメタデータ
+// 経由で受け渡し、以降に作られる各Parserへコンストラクタで登録する
+static std::vector<std::pair<char, int>> PreludeOperators;
+
+// パーサー
+// レキサーと構文解析の状態(現在のトークン、演算子優先順位表)をすべてインスタンスに持つ
+// 入力ファイルごとにParserを作れば複数スレッドで同時にパースできる
+// (生成されるASTノードはコンストラクタで渡されたアリーナが所有する)
+class Parser {
+    Lexer Lex;
+    // このパーサーが生成するASTノードを所有するアリーナ
+    ASTArena &Arena;
+    // パーサーが現在見ているトークン
+    int CurrentToken = 0;
+    // 二項演算子の優先順位
+    // トークンごとに引かれるテーブルなので、mapではなくASCII全域のフラットな配列で持つ(未登録は0)
+    // ユーザー定義演算子はパース時(ParsePrototype)にこの表へ登録されるため、
+    // 構文解析をコード生成から切り離して先行させられる
+    int BinaryOperatorPrecedence[128] = {};
+
+public:
+    explicit Parser(ASTArena &Arena): Arena(Arena) {
+        BinaryOperatorPrecedence['='] = 2;
+        BinaryOperatorPrecedence['<'] = 10;
+        BinaryOperatorPrecedence['+'] = 20;
+        BinaryOperatorPrecedence['-'] = 20;
+        BinaryOperatorPrecedence['*'] = 40;
+        // プレリュードで定義済みの演算子もパース可能にしておく
+        for (const auto &Op: PreludeOperators)
+            BinaryOperatorPrecedence[(unsigned char)Op.first] = Op.second;
+    }
+
+    Lexer &lexer() { return Lex; }
+    ASTArena &arena() { return Arena; }
+
+    // レキサーから別のトークンを読み込み、CurrentTokenを更新する
+    int getNextToken() {
+        TheStats.count(TheStats.TokensLexed);
+        return CurrentToken = Lex.getToken();
+    }
+    int current() const { return CurrentToken; }
+
+    // トップレベル項目1つ分(defとトップレベル式はFnAST、externはProtoAST)
+    struct Item {
+        std::unique_ptr<FunctionAST> FnAST;
+        std::unique_ptr<PrototypeAST> ProtoAST;
+    };
+
+    // EOFまで構文解析だけを行い、項目を1つパースするたびにSinkへ渡す
+    // コード生成を伴わないため、複数ファイルのパースを並列に実行でき、
+    // Sinkをキューにすればパースとコード生成をパイプライン化できる
+    template <typename SinkT>
+    void parseItems(SinkT &&Sink);
+
+    std::unique_ptr<FunctionAST> ParseDefinition();
+    std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+    std::unique_ptr<PrototypeAST> ParseExtern();
+
+private:
+    int GetTokenPrecedence();
+    ExprAST *ParseExpression();
+    ExprAST *ParseNumberExpr();
+    ExprAST *ParseParenExpr();
+    ExprAST *ParseIdentifierExpr();
+    ExprAST *ParseIfExpr();
+    ExprAST *ParseForExpr();
+    ExprAST *ParseVarExpr();
+    ExprAST *ParsePrimary();
+    ExprAST *ParseUnary();
+    ExprAST *ParseBinaryOperatorRHS(int ExprPrecedence, ExprAST *LHS);
+    std::unique_ptr<PrototypeAST> ParsePrototype();
+};
+
+// 現在のトークンの優先順位が返却される
+// 二項演算子でない場合は-1が返却される
+int Parser::GetTokenPrecedence() {
+    if (!isascii(CurrentToken))
+        return -1;
+
+    int TokenPrecedence = BinaryOperatorPrecedence[CurrentToken];
+    if (TokenPrecedence <= 0)
+        return -1;
+    return TokenPrecedence;
+}
 
 // 数値リテラルをパース
 // CurrentTokenがtoken_numberの際に呼び出される
 // 現在の数値を取り、NumberExprASTノードを作成し、レキサーを次のトークンに進め、最後に返却する
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
+ExprAST *Parser::ParseNumberExpr() {
+    auto *Result = Arena.create<NumberExprAST>(Lex.NumVal);
     getNextToken();
-    return std::move(Result);
+    return Result;
 }
 
 // 括弧演算子をパース
 // CurrentTokenが'('の際に呼び出される
 // 再帰になっている
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+ExprAST *Parser::ParseParenExpr() {
     getNextToken();
     auto V = ParseExpression();
     if (!V)
@@ -323,21 +903,32 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 // 識別子をパース
 // CurrentTokenがtoken_identifierの際に呼び出される([a-zA-Z][a-zA-Z0-9]*)
 // 変数参照か関数呼び出し式かを判断している
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
+ExprAST *Parser::ParseIdentifierExpr() {
+    Symbol IdName = Lex.IdentifierSym;
 
     getNextToken(); // 識別子を読み進める
 
+    if (CurrentToken == '[') { // 配列要素参照の場合
+        getNextToken(); // '['を読み進める
+        auto *Index = ParseExpression();
+        if (!Index)
+            return nullptr;
+        if (CurrentToken != ']')
+            return LogError("expected ']' after array index");
+        getNextToken();
+        return Arena.create<IndexExprAST>(IdName, Index);
+    }
+
     if (CurrentToken != '(') // 変数参照の場合
-        return std::make_unique<VariableExprAST>(IdName);
+        return Arena.create<VariableExprAST>(IdName);
 
     // 関数呼び出し式の場合
     getNextToken(); // '('を読み進める
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    std::vector<ExprAST *> Args;
     if (CurrentToken != ')') {
         while (true) {
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
+            if (auto *Arg = ParseExpression())
+                Args.push_back(Arg);
             else
                 return nullptr;
             if (CurrentToken == ')')
@@ -348,10 +939,10 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
         }
     }
     getNextToken();
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    return Arena.create<CallExprAST>(IdName, std::move(Args));
 }
 
-static std::unique_ptr<ExprAST> ParseIfExpr() {
+ExprAST *Parser::ParseIfExpr() {
     getNextToken();
 
     auto Condition = ParseExpression();
@@ -374,17 +965,17 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
     if (!Else)
         return nullptr;
 
-    return std::make_unique<IfExprAST>(std::move(Condition), std::move(Then), std::move(Else));
+    return Arena.create<IfExprAST>(Condition, Then, Else);
 }
 
 // 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr() {
+ExprAST *Parser::ParseForExpr() {
     getNextToken();
 
     if (CurrentToken != token_identifier)
         return LogError("expected identifier after for");
 
-    std::string IdName = IdentifierStr;
+    Symbol IdName = Lex.IdentifierSym;
     getNextToken();
 
     if (CurrentToken != '=')
@@ -404,7 +995,7 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
 
     // Stepはオプション
     // 2番目のカンマが存在するかどうかで判断
-    std::unique_ptr<ExprAST> Step;
+    ExprAST *Step = nullptr;
     if (CurrentToken == ',') {
         getNextToken();
         Step = ParseExpression();
@@ -420,23 +1011,32 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     if (!Body)
         return nullptr;
 
-    return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End), std::move(Step), std::move(Body));
+    return Arena.create<ForExprAST>(IdName, Start, End, Step, Body);
 }
 
-static std::unique_ptr<ExprAST> ParseVarExpr() {
+ExprAST *Parser::ParseVarExpr() {
     getNextToken();
 
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    std::vector<VarExprAST::VarDecl> VarNames;
 
     if (CurrentToken != token_identifier)
         return LogError("expected identifier after var");
 
     while (true) {
-        std::string Name = IdentifierStr;
+        Symbol Name = Lex.IdentifierSym;
         getNextToken();
 
-        std::unique_ptr<ExprAST> Init = nullptr;
-        if (CurrentToken == '=') {
+        ExprAST *Init = nullptr;
+        ExprAST *Size = nullptr;
+        if (CurrentToken == '[') { // 配列宣言(要素はすべて0で初期化される)
+            getNextToken();
+            Size = ParseExpression();
+            if (!Size)
+                return nullptr;
+            if (CurrentToken != ']')
+                return LogError("expected ']' after array size");
+            getNextToken();
+        } else if (CurrentToken == '=') {
             getNextToken();
 
             Init = ParseExpression();
@@ -444,7 +1044,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
                 return nullptr;
         }
 
-        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        VarNames.push_back(VarExprAST::VarDecl{Name, Init, Size});
 
         if (CurrentToken != ',')
             break;
@@ -462,11 +1062,11 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
     if (!Body)
         return nullptr;
 
-    return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    return Arena.create<VarExprAST>(std::move(VarNames), Body);
 }
 
 // 任意の一次式をパース
-static std::unique_ptr<ExprAST> ParsePrimary() {
+ExprAST *Parser::ParsePrimary() {
     switch (CurrentToken) {
         default:
             return LogError("unknown token when expecting an expression");
@@ -485,7 +1085,7 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
     }
 }
 
-static std::unique_ptr<ExprAST> ParseUnary() {
+ExprAST *Parser::ParseUnary() {
     // CurrentTokenが演算子でない場合は、PrimaryExprでなければならない
     if (!isascii(CurrentToken) || CurrentToken == '(' || CurrentToken == ',')
         return ParsePrimary();
@@ -494,8 +1094,8 @@ static std::unique_ptr<ExprAST> ParseUnary() {
     // 演算子をOpcodeとする
     int Opc = CurrentToken;
     getNextToken();
-    if (auto Operand = ParseUnary()) // 残りの部分を単項演算子としてパースする
-        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+    if (auto *Operand = ParseUnary()) // 残りの部分を単項演算子としてパースする
+        return Arena.create<UnaryExprAST>(Opc, Operand);
     return nullptr;
 }
 
@@ -503,7 +1103,7 @@ static std::unique_ptr<ExprAST> ParseUnary() {
 // 優先順位とこれまでにパースされた部分の式へのポインタを受け取る
 // 渡される優先順位の値は、この関数が処理することができる最小の演算子の優先順位
 // BinaryOperatorRHSは空も許容し、その場合はLHSを返す
-static std::unique_ptr<ExprAST> ParseBinaryOperatorRHS(int ExprPrecedence, std::unique_ptr<ExprAST> LHS) {
+ExprAST *Parser::ParseBinaryOperatorRHS(int ExprPrecedence, ExprAST *LHS) {
     while (true) {
         int TokenPrecedence = GetTokenPrecedence();
         if (TokenPrecedence < ExprPrecedence) // 現在のトークンの優先順位が引数で渡された優先順位より低い場合
@@ -513,21 +1113,21 @@ static std::unique_ptr<ExprAST> ParseBinaryOperatorRHS(int ExprPrecedence, std::
         int BinaryOperator = CurrentToken;
         getNextToken(); // 二項演算子を読み進める
 
-        auto RHS = ParseUnary();
+        auto *RHS = ParseUnary();
         if (!RHS)
             return nullptr;
 
         int NextPrecedence = GetTokenPrecedence();
         if (TokenPrecedence < NextPrecedence) { // 前の二項演算子がCurrentが指している二項演算子より小さい場合(例: a + b * c)
             // a + (b binop unparsed)
-            RHS = ParseBinaryOperatorRHS(TokenPrecedence + 1, std::move(RHS)); // '+'よりも高い優先順位のペアのシーケンスは、一緒に解析されてRHSとして返される
+            RHS = ParseBinaryOperatorRHS(TokenPrecedence + 1, RHS); // '+'よりも高い優先順位のペアのシーケンスは、一緒に解析されてRHSとして返される
             if (!RHS)
                 return nullptr;
         }
 
         // 同じか大きい場合(例: a + b + c, a * b + c)
         // (a+b) binop unparsed
-        LHS = std::make_unique<BinaryExprAST>(BinaryOperator, std::move(LHS), std::move(RHS));
+        LHS = Arena.create<BinaryExprAST>(BinaryOperator, LHS, RHS);
     }
 }
 
@@ -535,17 +1135,17 @@ static std::unique_ptr<ExprAST> ParseBinaryOperatorRHS(int ExprPrecedence, std::
 // 二項演算子で区切られた一次式の流れとして考える
 // "a+b+(c+d)*e*f+g" => 「a」を解析し、次に[+, b] [+, (c+d)] [*, e] [*, f] [+, g] のペアを順番に見ていく
 // 括弧は一次式なので、二項演算子のパーサーは考慮する必要がない
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParseUnary(); // 上記例の'a'をパース(CurrentTokenは'+'になる)
+ExprAST *Parser::ParseExpression() {
+    auto *LHS = ParseUnary(); // 上記例の'a'をパース(CurrentTokenは'+'になる)
     if (!LHS)
         return nullptr;
 
-    return ParseBinaryOperatorRHS(0, std::move(LHS));
+    return ParseBinaryOperatorRHS(0, LHS);
 }
 
 // 関数のプロトタイプをパース
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-    std::string FnName;
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
+    Symbol FnName = nullptr;
 
     unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary
     unsigned BinaryPrecedence = 30;
@@ -554,7 +1154,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
         default:
             return LogErrorP("Expected function name in prototype");
         case token_identifier:
-            FnName = IdentifierStr;
+            FnName = Lex.IdentifierSym;
             Kind = 0;
             getNextToken();
             break;
@@ -562,38 +1162,61 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
             getNextToken();
             if (!isascii(CurrentToken))
                 return LogErrorP("Expected unary operator");
-            FnName = "unary";
-            FnName += (char)CurrentToken;
+            FnName = TheInterner.intern(std::string("unary") + (char)CurrentToken);
             Kind = 1;
             getNextToken();
             break;
-        case token_binary:
+        case token_binary: {
             getNextToken();
             if (!isascii(CurrentToken))
                 return LogErrorP("Expected binary operator");
+            char Op = (char)CurrentToken;
             // 二項演算子だった場合、関数名は"binary~~になる"(例: "@"演算子の場合、"binary@"のような名前を構築する)
             // LLVMのシンボルテーブルのシンボル名には、nullの埋め込みも含めて、どんな文字でも許される
-            FnName = "binary";
-            FnName += (char)CurrentToken;
+            FnName = TheInterner.intern(std::string("binary") + Op);
             Kind = 2;
             getNextToken();
 
             if (CurrentToken == token_number) {
-                if (NumVal < 1 || NumVal > 100)
+                if (Lex.NumVal < 1 || Lex.NumVal > 100)
                     return LogErrorP("Invalid precedence: must be 1..100");
-                BinaryPrecedence = (unsigned)NumVal;
+                BinaryPrecedence = (unsigned)Lex.NumVal;
                 getNextToken();
             }
+            // 優先順位表への登録はコード生成時ではなくここで行う
+            // (本体や後続の式がこの演算子を使えればよく、構文解析が先行できる)
+            BinaryOperatorPrecedence[(unsigned char)Op] = (int)BinaryPrecedence;
             break;
+        }
     }
 
     if (CurrentToken != '(')
         return LogErrorP("Expected '(' in prototype");
 
     // 引数名のリストを読み込む
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == token_identifier)
-        ArgNames.push_back(IdentifierStr);
+    // 'name[]'は配列引数(double*)、'name<>'はベクトル引数(<4 x double>)として渡される
+    std::vector<Symbol> ArgNames;
+    std::vector<PrototypeAST::ArgKind> ArgKinds;
+    getNextToken();
+    while (CurrentToken == token_identifier) {
+        ArgNames.push_back(Lex.IdentifierSym);
+        getNextToken();
+        PrototypeAST::ArgKind ArgKind = PrototypeAST::ak_scalar;
+        if (CurrentToken == '[') {
+            getNextToken();
+            if (CurrentToken != ']')
+                return LogErrorP("Expected ']' in array parameter");
+            ArgKind = PrototypeAST::ak_array;
+            getNextToken();
+        } else if (CurrentToken == '<') {
+            getNextToken();
+            if (CurrentToken != '>')
+                return LogErrorP("Expected '>' in vector parameter");
+            ArgKind = PrototypeAST::ak_vector;
+            getNextToken();
+        }
+        ArgKinds.push_back(ArgKind);
+    }
     if (CurrentToken != ')')
         return LogErrorP("Expected ')' in prototype");
 
@@ -602,33 +1225,416 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     if (Kind && ArgNames.size() != Kind)
         return LogErrorP("Invalid number of operands for operator");
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0, BinaryPrecedence);
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0, BinaryPrecedence, std::move(ArgKinds));
 }
 
 // 関数定義をパース
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
     getNextToken();
     auto Proto = ParsePrototype();
     if (!Proto)
         return nullptr;
 
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    if (auto *E = ParseExpression())
+        return std::make_unique<FunctionAST>(std::move(Proto), E);
     return nullptr;
 }
 
 // トップレベルの式をそのまま評価できるようにする
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()) {
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+// JITモードでは評価後にResourceTrackerで丸ごと回収されるため、名前は毎回同じで良い
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
+    if (auto *E = ParseExpression()) {
+        auto Proto = std::make_unique<PrototypeAST>(TheInterner.intern("__anon_expr"), std::vector<Symbol>());
+        return std::make_unique<FunctionAST>(std::move(Proto), E);
     }
     return nullptr;
 }
 
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
+    getNextToken();
+    auto Proto = ParsePrototype();
+    if (Proto)
+        Proto->markExtern();
+    return Proto;
+}
+
+// EOFまで構文解析だけを行い、項目をパースでき次第Sinkへ渡す(MainLoopのパース専用版)
+// パース失敗時はMainLoop同様にトークンを1つ読み捨てて回復する
+template <typename SinkT>
+void Parser::parseItems(SinkT &&Sink) {
     getNextToken();
-    return ParsePrototype();
+    while (true) {
+        switch (CurrentToken) {
+            case token_eof:
+                return;
+            case ';':
+                getNextToken();
+                break;
+            case token_def:
+                if (auto FnAST = ParseDefinition())
+                    Sink(Item{std::move(FnAST), nullptr});
+                else
+                    getNextToken();
+                break;
+            case token_extern:
+                if (auto ProtoAST = ParseExtern())
+                    Sink(Item{nullptr, std::move(ProtoAST)});
+                else
+                    getNextToken();
+                break;
+            default:
+                if (auto FnAST = ParseTopLevelExpr())
+                    Sink(Item{std::move(FnAST), nullptr});
+                else
+                    getNextToken();
+                break;
+        }
+    }
+}
+
+
+//===----------------------------------------------------------------------===//
+// Binary AST cache
+//===----------------------------------------------------------------------===//
+
+// -ast-cacheでパース結果のバイナリキャッシュを有効にする(バッチモード用)
+// 各入力の隣に<入力ファイル>.astcを書き出し、ソース内容のMD5が一致する限り
+// 次回以降はレキサー/パーサーを丸ごと飛ばしてASTを復元し、直接コード生成へ入れる
+static bool ASTCacheEnabled = false;
+
+namespace {
+    // キャッシュ形式: ヘッダ(マジック+版数+ソースのMD5)、インターン文字列表、
+    // トップレベル項目の列。ASTノードはポインタでつながっているため、シンボルは
+    // 文字列表の添字、子ノードは深さ優先の並びで表す(省略可能な子は有無フラグ付き)
+    constexpr char ASTCacheMagic[4] = {'K', 'A', 'S', 'T'};
+    constexpr uint32_t ASTCacheVersion = 1;
+
+    // ASTをバイト列へ直列化する(パース中にSink経由で項目ごとに呼ばれる)
+    class ASTWriter {
+        std::string Items;
+        std::string Strings;
+        std::unordered_map<Symbol, uint32_t> SymbolIndex;
+        uint32_t NumStrings = 0;
+        uint32_t NumItems = 0;
+
+        void u8(uint8_t V) { Items.push_back((char)V); }
+        void u32(uint32_t V) { Items.append((const char *)&V, 4); }
+        void f64(double V) { Items.append((const char *)&V, 8); }
+        void sym(Symbol S) {
+            auto It = SymbolIndex.find(S);
+            if (It == SymbolIndex.end()) {
+                It = SymbolIndex.emplace(S, NumStrings++).first;
+                uint32_t Len = (uint32_t)S->size();
+                Strings.append((const char *)&Len, 4);
+                Strings.append(*S);
+            }
+            u32(It->second);
+        }
+        // 省略可能な子ノード(forのステップ、varの初期値/要素数)
+        void opt(const ExprAST *E) {
+            u8(E != nullptr);
+            if (E)
+                expr(E);
+        }
+
+        void expr(const ExprAST *E) {
+            u8((uint8_t)E->getKind());
+            switch (E->getKind()) {
+                case ExprAST::ek_number:
+                    f64(cast<NumberExprAST>(E)->getVal());
+                    break;
+                case ExprAST::ek_variable:
+                    sym(cast<VariableExprAST>(E)->getName());
+                    break;
+                case ExprAST::ek_binary: {
+                    const auto *B = cast<BinaryExprAST>(E);
+                    u8((uint8_t)B->getOp());
+                    expr(B->getLHS());
+                    expr(B->getRHS());
+                    break;
+                }
+                case ExprAST::ek_unary: {
+                    const auto *U = cast<UnaryExprAST>(E);
+                    u8((uint8_t)U->getOpcode());
+                    expr(U->getOperand());
+                    break;
+                }
+                case ExprAST::ek_call: {
+                    const auto *C = cast<CallExprAST>(E);
+                    sym(C->getCallee());
+                    u32((uint32_t)C->getArgs().size());
+                    for (const ExprAST *Arg: C->getArgs())
+                        expr(Arg);
+                    break;
+                }
+                case ExprAST::ek_if: {
+                    const auto *I = cast<IfExprAST>(E);
+                    expr(I->getCondition());
+                    expr(I->getThen());
+                    expr(I->getElse());
+                    break;
+                }
+                case ExprAST::ek_for: {
+                    const auto *F = cast<ForExprAST>(E);
+                    sym(F->getVarName());
+                    expr(F->getStart());
+                    expr(F->getEnd());
+                    opt(F->getStep());
+                    expr(F->getBody());
+                    break;
+                }
+                case ExprAST::ek_var: {
+                    const auto *V = cast<VarExprAST>(E);
+                    u32((uint32_t)V->getVarNames().size());
+                    for (const auto &D: V->getVarNames()) {
+                        sym(D.Name);
+                        opt(D.Init);
+                        opt(D.Size);
+                    }
+                    expr(V->getBody());
+                    break;
+                }
+                case ExprAST::ek_index: {
+                    const auto *I = cast<IndexExprAST>(E);
+                    sym(I->getArrayName());
+                    expr(I->getIndex());
+                    break;
+                }
+            }
+        }
+
+        void proto(const PrototypeAST &P) {
+            sym(P.getName());
+            const auto &Args = P.getArgs();
+            u32((uint32_t)Args.size());
+            for (unsigned I = 0; I < Args.size(); ++I) {
+                sym(Args[I]);
+                u8((uint8_t)P.getArgKind(I));
+            }
+            u8(P.isUnaryOperator() || P.isBinaryOperator());
+            u32(P.getBinaryPrecedence());
+            u8(P.isExtern());
+        }
+
+    public:
+        void item(const Parser::Item &I) {
+            ++NumItems;
+            if (I.FnAST) {
+                u8(1);
+                proto(I.FnAST->getProto());
+                expr(I.FnAST->getBody());
+            } else {
+                u8(0);
+                proto(*I.ProtoAST);
+            }
+        }
+
+        bool writeFile(const std::string &Path, const MD5::MD5Result &Digest) {
+            std::error_code EC;
+            raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+            if (EC)
+                return false;
+            OS.write(ASTCacheMagic, 4);
+            OS.write((const char *)&ASTCacheVersion, 4);
+            OS.write((const char *)Digest.Bytes.data(), 16);
+            OS.write((const char *)&NumStrings, 4);
+            OS << Strings;
+            OS.write((const char *)&NumItems, 4);
+            OS << Items;
+            return true;
+        }
+    };
+
+    // キャッシュからASTを復元する。バイト列が壊れていたら偽を返して
+    // 通常のパースへフォールバックする(項目は全体の復元に成功してから
+    // まとめてSinkへ流すので、失敗時に中途半端な項目は流れない)
+    class ASTReader {
+        const char *Cur, *End;
+        std::vector<Symbol> Symbols;
+        ASTArena &Arena;
+        bool OK = true;
+
+        bool take(void *Dst, size_t N) {
+            if ((size_t)(End - Cur) < N) {
+                OK = false;
+                return false;
+            }
+            memcpy(Dst, Cur, N);
+            Cur += N;
+            return true;
+        }
+        uint8_t u8() {
+            uint8_t V = 0;
+            take(&V, 1);
+            return V;
+        }
+        uint32_t u32() {
+            uint32_t V = 0;
+            take(&V, 4);
+            return V;
+        }
+        double f64() {
+            double V = 0;
+            take(&V, 8);
+            return V;
+        }
+        Symbol sym() {
+            uint32_t Idx = u32();
+            if (Idx >= Symbols.size()) {
+                OK = false;
+                return nullptr;
+            }
+            return Symbols[Idx];
+        }
+        ExprAST *opt() { return u8() ? expr() : nullptr; }
+
+        ExprAST *expr() {
+            if (!OK)
+                return nullptr;
+            switch (u8()) {
+                case ExprAST::ek_number:
+                    return Arena.create<NumberExprAST>(f64());
+                case ExprAST::ek_variable: {
+                    Symbol Name = sym();
+                    return OK ? Arena.create<VariableExprAST>(Name) : nullptr;
+                }
+                case ExprAST::ek_binary: {
+                    char Op = (char)u8();
+                    ExprAST *LHS = expr();
+                    ExprAST *RHS = expr();
+                    return OK ? Arena.create<BinaryExprAST>(Op, LHS, RHS) : nullptr;
+                }
+                case ExprAST::ek_unary: {
+                    char Opcode = (char)u8();
+                    ExprAST *Operand = expr();
+                    return OK ? Arena.create<UnaryExprAST>(Opcode, Operand) : nullptr;
+                }
+                case ExprAST::ek_call: {
+                    Symbol Callee = sym();
+                    uint32_t N = u32();
+                    std::vector<ExprAST *> Args;
+                    for (uint32_t I = 0; OK && I < N; ++I)
+                        Args.push_back(expr());
+                    return OK ? Arena.create<CallExprAST>(Callee, std::move(Args)) : nullptr;
+                }
+                case ExprAST::ek_if: {
+                    ExprAST *Condition = expr();
+                    ExprAST *Then = expr();
+                    ExprAST *Else = expr();
+                    return OK ? Arena.create<IfExprAST>(Condition, Then, Else) : nullptr;
+                }
+                case ExprAST::ek_for: {
+                    Symbol VarName = sym();
+                    ExprAST *Start = expr();
+                    ExprAST *EndE = expr();
+                    ExprAST *Step = opt();
+                    ExprAST *Body = expr();
+                    return OK ? Arena.create<ForExprAST>(VarName, Start, EndE, Step, Body) : nullptr;
+                }
+                case ExprAST::ek_var: {
+                    uint32_t N = u32();
+                    std::vector<VarExprAST::VarDecl> Decls;
+                    for (uint32_t I = 0; OK && I < N; ++I) {
+                        Symbol Name = sym();
+                        ExprAST *Init = opt();
+                        ExprAST *Size = opt();
+                        Decls.push_back({Name, Init, Size});
+                    }
+                    ExprAST *Body = expr();
+                    return OK ? Arena.create<VarExprAST>(std::move(Decls), Body) : nullptr;
+                }
+                case ExprAST::ek_index: {
+                    Symbol ArrayName = sym();
+                    ExprAST *Index = expr();
+                    return OK ? Arena.create<IndexExprAST>(ArrayName, Index) : nullptr;
+                }
+                default:
+                    OK = false;
+                    return nullptr;
+            }
+        }
+
+        std::unique_ptr<PrototypeAST> proto() {
+            Symbol Name = sym();
+            uint32_t NumArgs = u32();
+            std::vector<Symbol> Args;
+            std::vector<PrototypeAST::ArgKind> ArgKinds;
+            for (uint32_t I = 0; OK && I < NumArgs; ++I) {
+                Args.push_back(sym());
+                ArgKinds.push_back((PrototypeAST::ArgKind)u8());
+            }
+            bool IsOperator = u8();
+            uint32_t Precedence = u32();
+            bool IsExtern = u8();
+            if (!OK)
+                return nullptr;
+            auto P = std::make_unique<PrototypeAST>(Name, std::move(Args), IsOperator,
+                                                    Precedence, std::move(ArgKinds));
+            if (IsExtern)
+                P->markExtern();
+            return P;
+        }
+
+    public:
+        ASTReader(const char *Begin, const char *End, ASTArena &Arena)
+                : Cur(Begin), End(End), Arena(Arena) {}
+
+        template <typename SinkT>
+        bool readAll(SinkT &&Sink) {
+            uint32_t NumStrings = u32();
+            for (uint32_t I = 0; OK && I < NumStrings; ++I) {
+                uint32_t Len = u32();
+                if ((size_t)(End - Cur) < Len) {
+                    OK = false;
+                    break;
+                }
+                Symbols.push_back(TheInterner.intern(std::string_view(Cur, Len)));
+                Cur += Len;
+            }
+            uint32_t NumItems = u32();
+            std::vector<Parser::Item> Items;
+            for (uint32_t I = 0; OK && I < NumItems; ++I) {
+                bool IsFunction = u8();
+                auto Proto = proto();
+                if (IsFunction) {
+                    ExprAST *Body = expr();
+                    if (!OK)
+                        return false;
+                    Items.push_back(Parser::Item{
+                            std::make_unique<FunctionAST>(std::move(Proto), Body), nullptr});
+                } else {
+                    if (!OK)
+                        return false;
+                    Items.push_back(Parser::Item{nullptr, std::move(Proto)});
+                }
+            }
+            if (!OK)
+                return false;
+            for (auto &I: Items)
+                Sink(std::move(I));
+            return true;
+        }
+    };
+}
+
+// <入力>.astcのヘッダを検証し、ソース内容のMD5が一致すればASTを復元してSinkへ流す
+template <typename SinkT>
+static bool LoadCachedAST(const std::string &CachePath, const MD5::MD5Result &Digest,
+                          ASTArena &Arena, SinkT &&Sink) {
+    auto BufOrErr = MemoryBuffer::getFile(CachePath);
+    if (!BufOrErr)
+        return false;
+    StringRef Data = (*BufOrErr)->getBuffer();
+    if (Data.size() < 24 || memcmp(Data.data(), ASTCacheMagic, 4) != 0)
+        return false;
+    uint32_t Version;
+    memcpy(&Version, Data.data() + 4, 4);
+    if (Version != ASTCacheVersion)
+        return false;
+    if (memcmp(Data.data() + 8, Digest.Bytes.data(), 16) != 0)
+        return false; // ソースが変更されている
+    ASTReader Reader(Data.data() + 24, Data.data() + Data.size(), Arena);
+    return Reader.readAll(std::forward<SinkT>(Sink));
 }
 
 //===----------------------------------------------------------------------===//
@@ -641,41 +1647,186 @@ static std::unique_ptr<LLVMContext> TheContext;
 static std::unique_ptr<IRBuilder<>> Builder;
 // 関数とグローバル変数を含むLLVMの構成要素。LLVM IRがコードを含むために使用する可能性の高いトップレベルの構造。codegen()メソッドがunique_ptr<Value>ではなく、生のValue*を返す理由であり、生成するすべてのIRのためのメモリを所有する
 static std::unique_ptr<Module> TheModule;
-// 現在のスコープでどの値が定義され、そのLLVM表現が何であるかを追跡する(コードのシンボルテーブル)。現状は関数パラメータのみ参照できる。
-static std::map<std::string, AllocaInst *> NamedValues;
-static std::unique_ptr<legacy::FunctionPassManager> TheFunctionPassManager;
+// スコープ付きシンボルテーブル(llvm::ScopedHashTable流)
+// インターン済みシンボルをキーにしたハッシュ表で、挿入/検索はO(1)
+// Scopeの破棄時に、そのスコープで行った挿入だけを逆順に巻き戻す(シャドーイングも定数時間で復元)
+class ScopedSymbolTable {
+    std::unordered_map<Symbol, Value *> Table;
+    // スコープ巻き戻し用: (シンボル, シャドーされていた旧値(無ければnullptr))
+    std::vector<std::pair<Symbol, Value *>> Undo;
+
+    void popTo(size_t Top) {
+        while (Undo.size() > Top) {
+            auto &Entry = Undo.back();
+            if (Entry.second)
+                Table[Entry.first] = Entry.second;
+            else
+                Table.erase(Entry.first);
+            Undo.pop_back();
+        }
+    }
+
+public:
+    // RAIIスコープ。破棄時にこのスコープでの挿入をすべて巻き戻す
+    class Scope {
+        ScopedSymbolTable &T;
+        size_t SavedTop;
+    public:
+        Scope(ScopedSymbolTable &T): T(T), SavedTop(T.Undo.size()) {}
+        ~Scope() { T.popTo(SavedTop); }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
+
+    void insert(Symbol Name, Value *V) {
+        auto It = Table.find(Name);
+        Undo.emplace_back(Name, It != Table.end() ? It->second : nullptr);
+        Table[Name] = V;
+    }
+
+    Value *lookup(Symbol Name) const {
+        auto It = Table.find(Name);
+        return It != Table.end() ? It->second : nullptr;
+    }
+
+    // 関数の切り替わり時にすべて破棄する
+    void clear() {
+        Table.clear();
+        Undo.clear();
+    }
+};
+
+// 現在のスコープでどの値が定義され、そのLLVM表現が何であるかを追跡する(コードのシンボルテーブル)
+// 値は代入される変数ならAllocaInst、そうでなければSSA値そのもの
+static ScopedSymbolTable NamedValues;
+// 現在codegen中の関数本体で'='による代入対象になる変数(allocaが必要)
+static std::unordered_set<Symbol> MutatedVars;
+
+// 新PassManager一式
+// 関数単位の簡約パイプラインをcodegen直後に、モジュール全体のパイプライン(ベクタライザ込み)をオブジェクト出力前に回す
+static std::unique_ptr<FunctionPassManager> TheFPM;
+static std::unique_ptr<LoopAnalysisManager> TheLAM;
+static std::unique_ptr<FunctionAnalysisManager> TheFAM;
+static std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
+static std::unique_ptr<ModuleAnalysisManager> TheMAM;
+// -O0/-O1/-O2/-O3で選択される最適化レベル(デフォルトはO2)
+static OptimizationLevel OptLevel = OptimizationLevel::O2;
+// ホストCPU向けに構成したTargetMachine(起動時に作成)
+static TargetMachine *TheTargetMachine = nullptr;
 // sinやcosを呼べる
 // JITに追加されたすべてのモジュールを、新しいものから順に検索し、最新の定義を見つける
 // 見つからない場合は、Kaleidoscopeプロセス自体で "dlsym("sin")" を呼び出す
 // libm版のsinを直接呼び出される
-//static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+static std::unique_ptr<orc::KaleidoscopeJIT> TheJIT;
+// -obj-cacheで有効になるコンパイル済みオブジェクトのディスクキャッシュ
+static std::unique_ptr<orc::KaleidoscopeObjectCache> TheObjectCache;
+// シンボルはインターン済みポインタなので、順序付きmapではなくハッシュ表で引く
+static std::unordered_map<Symbol, std::unique_ptr<PrototypeAST>> FunctionProtos;
 static ExitOnError ExitOnErr;
 
+// 階層型JIT(JITモードのみ)
+// 初回は軽い最適化(O1)で素早くコンパイルし、関数入口に実行回数カウンタを
+// 仕込んでおく。しきい値に達した関数はビットコードからO3で再コンパイルし、
+// ホット用dylibへ追加する(以降の参照は最適化版に束縛される)
+static constexpr uint64_t HotThreshold = 1000;
+// 定義ごとのビットコード(ホット時の再コンパイル元。calleeのインライン展開にも使う)
+static std::map<Symbol, std::string> FunctionBitcode;
+// JITコード内のフックが積む、しきい値に達した関数名
+static std::mutex HotMutex;
+static std::vector<std::string> PendingHotNames;
+// 再コンパイル済みの関数(二度目以降の通知は無視する)
+static std::unordered_set<Symbol> RecompiledHot;
+
 Value *LogErrorV(const char *Str) {
     LogError(Str);
     return nullptr;
 }
 
-// TheModuleを検索して既存の関数宣言を見つけ、見つからなければFunctionProtosから新しい宣言を生成するようにフォールバック
-Function *getFunction(std::string Name) {
-    if (auto *F = TheModule->getFunction(Name))
-        return F;
+// 解決済み呼び出し先のメモ化キャッシュ
+// 呼び出しと演算子適用のたびにモジュールの文字列検索とFunctionProtosの検索を
+// 繰り返さないよう、シンボル→Function*を世代付きで覚える。モジュールが
+// 作り直されるとFunction*は無効になるため、世代番号の繰り上げで一括無効化する
+static std::unordered_map<Symbol, std::pair<Function *, uint64_t>> ResolvedFunctions;
+static uint64_t ResolvedFunctionsGeneration = 0;
 
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
+// TheModuleを検索して既存の関数宣言を見つけ、見つからなければFunctionProtosから新しい宣言を生成するようにフォールバック
+Function *getFunction(Symbol Name) {
+    TheStats.count(TheStats.FunctionLookups);
+
+    auto Cached = ResolvedFunctions.find(Name);
+    if (Cached != ResolvedFunctions.end() &&
+        Cached->second.second == ResolvedFunctionsGeneration)
+        return Cached->second.first;
+
+    Function *F = TheModule->getFunction(*Name);
+    if (!F) {
+        auto FI = FunctionProtos.find(Name);
+        if (FI != FunctionProtos.end())
+            F = FI->second->codegen();
+    }
 
-    return nullptr;
+    // 未知の関数は覚えない(後からexternや定義が同じモジュールへ入りうる)
+    if (F)
+        ResolvedFunctions[Name] = {F, ResolvedFunctionsGeneration};
+    return F;
 }
 
 // 関数のエントリブロックにalloca命令を作成する
-// ミュータブル変数などに使用される
-static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName) {
+// ミュータブル変数などに使用される(省略時はdouble、ベクトル変数はベクトル型)
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName, Type *Ty = nullptr) {
     // エントリブロックの最初の命令(.begin())を指しているIRBuilderオブジェクトを作成
     IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
     // 期待される名前のallocaを作成し返却
-    return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, VarName);
+    return TmpB.CreateAlloca(Ty ? Ty : Type::getDoubleTy(*TheContext), nullptr, VarName);
+}
+
+// forループのバックエッジ分岐に!llvm.loopメタデータを付け、
+// ループベクタライザを明示的に許可する(アンロールのヒントは付けず、
+// パイプラインの既定のアンローラ判断に任せる)
+static void AttachLoopMetadata(BranchInst *Backedge) {
+    auto *EnableVectorize = MDNode::get(
+        *TheContext,
+        {MDString::get(*TheContext, "llvm.loop.vectorize.enable"),
+         ConstantAsMetadata::get(ConstantInt::getTrue(*TheContext))});
+    auto *LoopID = MDNode::getDistinct(*TheContext, {nullptr, EnableVectorize});
+    // 先頭オペランドはループID自身を指す決まり
+    LoopID->replaceOperandWith(0, LoopID);
+    Backedge->setMetadata(LLVMContext::MD_loop, LoopID);
+}
+
+// 固定幅SIMDベクトル型(<4 x double>)
+// 4要素はAVX/AVX2の1レジスタにちょうど収まり、SSE2のみのホストでも
+// 2命令に分割されるだけなので、どのターゲットでも素直にレガライズされる
+static constexpr unsigned VecWidth = 4;
+
+static Type *VecTy() {
+    return FixedVectorType::get(Type::getDoubleTy(*TheContext), VecWidth);
+}
+
+static bool IsVecValue(Value *V) { return V && V->getType()->isVectorTy(); }
+
+// 配列(ポインタ)やベクトルの値がスカラー文脈に紛れ込んでいないか確認する
+// (doubleを期待するIRBuilder呼び出しに渡す前に検出してクラッシュを防ぐ)
+static Value *RequireScalar(Value *V, const char *Msg) {
+    if (V && !V->getType()->isDoubleTy())
+        return LogErrorV(Msg);
+    return V;
+}
+
+// 配列束縛(double*)の要素アドレスを計算する
+// Kaleidoscopeの数値はすべてdoubleなので、添字はi64へ切り捨ててからGEPする
+static Value *EmitElementPtr(Symbol ArrayName, ExprAST *Index) {
+    Value *V = NamedValues.lookup(ArrayName);
+    if (!V)
+        return LogErrorV("Unknown array name");
+    // スカラーの可変変数(doubleのalloca)は添字アクセスの対象にならない
+    if (!V->getType()->isPointerTy() || isa<AllocaInst>(V))
+        return LogErrorV("indexed variable is not an array");
+    Value *Idx = RequireScalar(Index->codegen(), "array index must be a number");
+    if (!Idx)
+        return nullptr;
+    Value *IdxInt = Builder->CreateFPToSI(Idx, Type::getInt64Ty(*TheContext), "idx");
+    return Builder->CreateInBoundsGEP(Type::getDoubleTy(*TheContext), V, IdxInt, "elemptr");
 }
 
 Value *NumberExprAST::codegen() {
@@ -684,49 +1835,256 @@ Value *NumberExprAST::codegen() {
     return ConstantFP::get(*TheContext, APFloat(Val));
 }
 
-// 変数はスタック上に存在する
+// 代入される変数はスタック上のallocaに、それ以外はSSA値に直接束縛される
 Value *VariableExprAST::codegen() {
-    AllocaInst *A = NamedValues[Name];
-    if (!A)
-        LogErrorV("Unknown variable name");
-    return Builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
+    Value *V = NamedValues.lookup(Name);
+    if (!V)
+        return LogErrorV("Unknown variable name");
+    if (auto *A = dyn_cast<AllocaInst>(V))
+        return Builder->CreateLoad(A->getAllocatedType(), A, Name->c_str());
+    // 直接SSA束縛: ロード不要
+    return V;
 }
 
-Value *UnaryExprAST::codegen() {
-    Value *OperandV = Operand->codegen();
-    if (!OperandV)
-        return nullptr;
-
-    Function *F = getFunction(std::string("unary") + Opcode);
+// SIMDベクトル組み込み関数
+// 通常の関数解決より先に名前で引き当てる(CallExprAST::codegenから呼ばれる)
+//   splat(x)              すべてのレーンがxの<4 x double>
+//   lane(v, i)            vのi番目のレーン(extractelement)
+//   shuffle(v, w, i0..i3) 定数レーン番号0..7でvとwから選ぶ(shufflevector)
+//   reduce(v)             レーンの水平加算(順序保存のfadd reduce)
+//   vload(a, i)           配列aの要素iから4レーンをロード
+//   vstore(a, i, v)       配列aの要素iへ4レーンをストア(vを返す)
+// 組み込みでない名前はHandled=falseのまま返し、呼び出し側が通常の関数として扱う
+static Value *EmitVectorBuiltin(Symbol Callee, const std::vector<ExprAST *> &Args, bool &Handled) {
+    const std::string &Name = *Callee;
+    Handled = true;
+
+    if (Name == "splat" && Args.size() == 1) {
+        Value *X = RequireScalar(Args[0]->codegen(), "splat takes a number");
+        if (!X)
+            return nullptr;
+        return Builder->CreateVectorSplat(VecWidth, X, "splat");
+    }
+
+    if (Name == "lane" && Args.size() == 2) {
+        Value *V = Args[0]->codegen();
+        if (!V)
+            return nullptr;
+        if (!IsVecValue(V))
+            return LogErrorV("lane takes a vector");
+        Value *I = RequireScalar(Args[1]->codegen(), "lane index must be a number");
+        if (!I)
+            return nullptr;
+        return Builder->CreateExtractElement(
+                V, Builder->CreateFPToUI(I, Type::getInt64Ty(*TheContext), "laneidx"), "lane");
+    }
+
+    if (Name == "reduce" && Args.size() == 1) {
+        Value *V = Args[0]->codegen();
+        if (!V)
+            return nullptr;
+        if (!IsVecValue(V))
+            return LogErrorV("reduce takes a vector");
+        // 順序保存の水平加算(-0.0は加算の単位元)
+        return Builder->CreateFAddReduce(ConstantFP::get(Type::getDoubleTy(*TheContext), -0.0), V);
+    }
+
+    if (Name == "shuffle" && Args.size() == 2 + VecWidth) {
+        Value *V = Args[0]->codegen();
+        Value *W = Args[1]->codegen();
+        if (!V || !W)
+            return nullptr;
+        if (!IsVecValue(V) || !IsVecValue(W))
+            return LogErrorV("shuffle takes two vectors");
+        // レーン番号はshufflevectorの定数マスクになるため、定数でなければならない
+        int Mask[VecWidth];
+        for (unsigned i = 0; i != VecWidth; ++i) {
+            auto *N = dyn_cast<NumberExprAST>(Args[2 + i]);
+            if (!N || N->getVal() < 0 || N->getVal() >= 2 * VecWidth || N->getVal() != std::trunc(N->getVal()))
+                return LogErrorV("shuffle lane numbers must be integer constants in 0..7");
+            Mask[i] = (int)N->getVal();
+        }
+        return Builder->CreateShuffleVector(V, W, makeArrayRef(Mask, VecWidth), "shuf");
+    }
+
+    if ((Name == "vload" && Args.size() == 2) || (Name == "vstore" && Args.size() == 3)) {
+        Value *P = Args[0]->codegen();
+        if (!P)
+            return nullptr;
+        if (!P->getType()->isPointerTy() || isa<AllocaInst>(P))
+            return LogErrorV("first argument of vload/vstore must be an array");
+        Value *I = RequireScalar(Args[1]->codegen(), "vload/vstore index must be a number");
+        if (!I)
+            return nullptr;
+        Value *Elt = Builder->CreateInBoundsGEP(
+                Type::getDoubleTy(*TheContext), P,
+                Builder->CreateFPToSI(I, Type::getInt64Ty(*TheContext), "idx"), "elemptr");
+        Value *VP = Builder->CreateBitCast(Elt, VecTy()->getPointerTo(), "vecptr");
+        // 添字は要素単位なので8バイトのアラインメントしか保証されない
+        if (Name == "vload")
+            return Builder->CreateAlignedLoad(VecTy(), VP, Align(8), "vload");
+        Value *V = Args[2]->codegen();
+        if (!V)
+            return nullptr;
+        if (!IsVecValue(V))
+            return LogErrorV("vstore takes a vector value");
+        Builder->CreateAlignedStore(V, VP, Align(8));
+        return V;
+    }
+
+    Handled = false;
+    return nullptr;
+}
+
+// parallel_for組み込み
+//   parallel_for(f, begin, end)    fを[begin, end)の各整数iについて呼ぶ(f(i))
+//   parallel_for(f, a, begin, end) 共有配列aを渡して呼ぶ(f(a, i))
+// 反復はランタイムのワーカープールへ分配される。本体はレーンごとに独立で
+// なければならない(同じ要素への書き込みが競合しても検出はされない)
+static Value *EmitParallelFor(const std::vector<ExprAST *> &Args) {
+    auto *FnRef = dyn_cast<VariableExprAST>(Args[0]);
+    if (!FnRef)
+        return LogErrorV("first argument of parallel_for must be a function name");
+    Function *BodyF = getFunction(FnRef->getName());
+    if (!BodyF)
+        return LogErrorV("unknown parallel_for body function");
+
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    Type *DblPtrTy = DoubleTy->getPointerTo();
+    bool WithData = Args.size() == 4;
+    FunctionType *BFT = BodyF->getFunctionType();
+    if (WithData) {
+        if (BFT->getNumParams() != 2 || !BFT->getParamType(0)->isPointerTy() || !BFT->getParamType(1)->isDoubleTy())
+            return LogErrorV("parallel_for body must be defined as f(a[] i)");
+    } else {
+        if (BFT->getNumParams() != 1 || !BFT->getParamType(0)->isDoubleTy())
+            return LogErrorV("parallel_for body must be defined as f(i)");
+    }
+
+    // 本体はfastccの可能性があるため、ランタイムから関数ポインタ越しに呼べる
+    // C規約のラッパーを作る(配列なしの形では第1引数を無視する)
+    FunctionType *CBTy = FunctionType::get(Type::getVoidTy(*TheContext), {DblPtrTy, DoubleTy}, false);
+    std::string WrapperName = "__pfor." + *FnRef->getName();
+    Function *Wrapper = TheModule->getFunction(WrapperName);
+    if (!Wrapper) {
+        // モジュールをまたいでシンボルが衝突しないよう内部リンケージにする
+        Wrapper = Function::Create(CBTy, Function::InternalLinkage, WrapperName, TheModule.get());
+        IRBuilderBase::InsertPointGuard IPGuard(*Builder);
+        Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Wrapper));
+        std::vector<Value *> CallArgs;
+        if (WithData)
+            CallArgs = {Wrapper->getArg(0), Wrapper->getArg(1)};
+        else
+            CallArgs = {Wrapper->getArg(1)};
+        CallInst *CI = Builder->CreateCall(BodyF, CallArgs);
+        CI->setCallingConv(BodyF->getCallingConv());
+        // 本体の戻り値(double)は捨てる
+        Builder->CreateRetVoid();
+    }
+
+    Value *DataV;
+    unsigned RangeIdx = 1;
+    if (WithData) {
+        DataV = Args[1]->codegen();
+        if (!DataV)
+            return nullptr;
+        if (!DataV->getType()->isPointerTy() || isa<AllocaInst>(DataV))
+            return LogErrorV("second argument of parallel_for must be an array");
+        RangeIdx = 2;
+    } else {
+        DataV = ConstantPointerNull::get(cast<PointerType>(DblPtrTy));
+    }
+    Value *BeginV = RequireScalar(Args[RangeIdx]->codegen(), "parallel_for bounds must be numbers");
+    Value *EndV = BeginV ? RequireScalar(Args[RangeIdx + 1]->codegen(), "parallel_for bounds must be numbers") : nullptr;
+    if (!BeginV || !EndV)
+        return nullptr;
+
+    FunctionCallee Runtime = TheModule->getOrInsertFunction(
+            "kaleidoscope_parallel_for",
+            FunctionType::get(DoubleTy, {CBTy->getPointerTo(), DblPtrTy, DoubleTy, DoubleTy}, false));
+    return Builder->CreateCall(Runtime, {Wrapper, DataV, BeginV, EndV}, "pfor");
+}
+
+Value *IndexExprAST::codegen() {
+    Value *Ptr = EmitElementPtr(ArrayName, Index);
+    if (!Ptr)
+        return nullptr;
+    return Builder->CreateLoad(Type::getDoubleTy(*TheContext), Ptr, ArrayName->c_str());
+}
+
+Value *UnaryExprAST::codegen() {
+    Value *OperandV = RequireScalar(Operand->codegen(), "operand of unary operator must be a number");
+    if (!OperandV)
+        return nullptr;
+
+    Function *F = getFunction(TheInterner.intern(std::string("unary") + Opcode));
     if (!F)
         return LogErrorV("Unknown unary operator");
 
-    return Builder->CreateCall(F, OperandV, "unop");
+    CallInst *CI = Builder->CreateCall(F, OperandV, "unop");
+    CI->setCallingConv(F->getCallingConv());
+    CI->setTailCall();
+    return CI;
 }
 
 Value *BinaryExprAST::codegen() {
     if (Op == '=') {
-        VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
+        // 配列要素への代入(a[i] = v)はGEP+storeになる
+        if (auto *LHSI = dyn_cast<IndexExprAST>(LHS)) {
+            Value *Val = RequireScalar(RHS->codegen(), "array element stores take a number");
+            if (!Val)
+                return nullptr;
+            Value *Ptr = EmitElementPtr(LHSI->getArrayName(), LHSI->getIndex());
+            if (!Ptr)
+                return nullptr;
+            Builder->CreateStore(Val, Ptr);
+            return Val;
+        }
+
+        auto *LHSE = dyn_cast<VariableExprAST>(LHS);
         if (!LHSE)
             return LogErrorV("destination of '=' must be a variable");
 
         Value *Val = RHS->codegen();
         if (!Val)
             return nullptr;
+        if (Val->getType()->isPointerTy())
+            return LogErrorV("cannot assign an array to a variable");
 
-        Value *Variable = NamedValues[LHSE->getName()];
+        Value *Variable = NamedValues.lookup(LHSE->getName());
         if (!Variable)
             return LogErrorV("Unknown variable name");
+        // 代入対象は事前解析でalloca化されているはず
+        if (!isa<AllocaInst>(Variable))
+            return LogErrorV("destination of '=' is not mutable");
+        // 変数の型(double、またはベクトル束縛なら<4 x double>)と一致する必要がある
+        if (Val->getType() != cast<AllocaInst>(Variable)->getAllocatedType())
+            return LogErrorV("mismatched types in assignment");
 
         Builder->CreateStore(Val, Variable);
         return Val;
     }
 
     // それぞれ再帰的に出力
+    // 配列は要素参照か関数引数としてのみ使える(ポインタ値に算術は定義しない)
     Value *L = LHS->codegen();
     Value *R = RHS->codegen();
     if (!L || !R)
         return nullptr;
+    if (L->getType()->isPointerTy() || R->getType()->isPointerTy())
+        return LogErrorV("array value cannot be used in arithmetic");
+
+    // スカラーとベクトルが混在する場合はスカラーを全レーンへsplatして揃える
+    // 以降の組み込み演算子はdouble同士と同じ命令列で、ベクトルなら要素ごとに計算される
+    if (L->getType() != R->getType()) {
+        if (IsVecValue(L) && R->getType()->isDoubleTy())
+            R = Builder->CreateVectorSplat(VecWidth, R, "splat");
+        else if (IsVecValue(R) && L->getType()->isDoubleTy())
+            L = Builder->CreateVectorSplat(VecWidth, L, "splat");
+        else
+            return LogErrorV("mismatched operand types");
+    }
+    Type *OperandTy = L->getType();
 
     switch (Op) {
         case '+':
@@ -738,21 +2096,35 @@ Value *BinaryExprAST::codegen() {
         case '<':
             L = Builder->CreateFCmpULT(L, R, "cmptmp");
             // fcmp命令は常に「i1」値(1ビットの整数)を返すと規定されているが、0.0または1.0の値が欲しいので変換を行っている
-            return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+            // (ベクトル同士なら<4 x i1>を<4 x double>のレーンごとの0.0/1.0に変換する)
+            return Builder->CreateUIToFP(L, OperandTy, "booltmp");
         default:
             break;
     }
 
     // 組み込みの二項演算子でない場合、ユーザー定義の二項演算子である必要がある。それを呼び出す
     // シンボルテーブルから適切な演算子を探し、その演算子への関数呼び出しを生成する(ユーザー定義演算子は通常の関数として構築される)
-    Function *F = getFunction(std::string("binary") + Op);
+    if (IsVecValue(L))
+        return LogErrorV("user-defined operators take numbers");
+    Function *F = getFunction(TheInterner.intern(std::string("binary") + Op));
     assert(F && "binary operator not found!");
 
     Value *Ops[2] = { L, R };
-    return Builder->CreateCall(F, Ops, "binop");
+    CallInst *CI = Builder->CreateCall(F, Ops, "binop");
+    CI->setCallingConv(F->getCallingConv());
+    CI->setTailCall();
+    return CI;
 }
 
 Value *CallExprAST::codegen() {
+    // ベクトル組み込みとparallel_forはユーザー関数より先に解決される
+    bool Handled = false;
+    Value *Builtin = EmitVectorBuiltin(Callee, Args, Handled);
+    if (Handled)
+        return Builtin;
+    if (*Callee == "parallel_for" && (Args.size() == 3 || Args.size() == 4))
+        return EmitParallelFor(Args);
+
     // グローバルのModuleから取得
     Function *CalleeF = getFunction(Callee);
     if (!CalleeF)
@@ -762,18 +2134,32 @@ Value *CallExprAST::codegen() {
         return LogErrorV("Incorrect # arguments passed");
 
     std::vector<Value *> ArgsV;
+    bool PassesArray = false;
     for (unsigned i = 0, e = Args.size(); i != e; ++i) {
         // 各引数を再帰的にコード化
         ArgsV.push_back(Args[i]->codegen());
         if (!ArgsV.back())
             return nullptr;
+        // 配列引数はdouble*、スカラー引数はdoubleで渡す(不一致はここで検出する)
+        if (ArgsV.back()->getType() != CalleeF->getFunctionType()->getParamType(i))
+            return LogErrorV("array/scalar mismatch in call argument");
+        PassesArray |= ArgsV.back()->getType()->isPointerTy();
     }
 
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    CallInst *CI = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    // 呼び出し規約は呼び出し先に合わせる(fastcc関数はfastccで呼ぶ)
+    CI->setCallingConv(CalleeF->getCallingConv());
+    // スカラーだけの呼び出しは値渡しで、呼び出し先が呼び出し元のスタックに
+    // 触れることはないため、常にtailとしてマークできる
+    // 末尾位置にある再帰呼び出しはTailCallElim/コード生成でループ化される
+    // 配列を渡す場合は呼び出し元スタック上のバッファを指しうるためマークしない
+    if (!PassesArray)
+        CI->setTailCall();
+    return CI;
 }
 
 Value *IfExprAST::codegen() {
-    Value *ConditionV = Condition->codegen();
+    Value *ConditionV = RequireScalar(Condition->codegen(), "if condition must be a number");
     if (!ConditionV)
         return nullptr;
 
@@ -798,6 +2184,8 @@ Value *IfExprAST::codegen() {
     Value *ThenV = Then->codegen();
     if (!ThenV)
         return nullptr;
+    if (ThenV->getType()->isPointerTy())
+        return LogErrorV("if branches cannot evaluate to arrays");
 
     Builder->CreateBr(MergeBB);
     // Then->codegenによってブロックが変更されてしまう可能性がある(if/then/elseのネスト等)
@@ -810,13 +2198,16 @@ Value *IfExprAST::codegen() {
     Value *ElseV = Else->codegen();
     if (!ElseV)
         return nullptr;
+    // 両方の枝が同じ型(doubleか<4 x double>)に評価される必要がある
+    if (ElseV->getType() != ThenV->getType())
+        return LogErrorV("if branches must have the same type");
 
     Builder->CreateBr(MergeBB);
     ElseBB = Builder->GetInsertBlock();
 
     TheFunction->getBasicBlockList().push_back(MergeBB);
     Builder->SetInsertPoint(MergeBB);
-    PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+    PHINode *PN = Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
 
     // PHIのブロックと値のペアをセットアップ
     PN->addIncoming(ThenV, ThenBB);
@@ -827,128 +2218,347 @@ Value *IfExprAST::codegen() {
 Value *ForExprAST::codegen() {
     Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
-    // エントリーブロックの変数にAllocaを作成
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    // 整数の帰納変数が使えるか判定する
+    // 開始値とステップが整数値の定数で、かつループ変数が本体で代入されない場合は、
+    // allocaもFP加算も使わずi64のphiで回す(FAddのレイテンシが消え、
+    // トリップカウントがSCEVで解析できるようになりベクタライザが働きやすくなる)
+    auto GetIntegralConst = [](ExprAST *E, int64_t &Out) {
+        auto *N = dyn_cast_or_null<NumberExprAST>(E);
+        if (!N)
+            return false;
+        double V = N->getVal();
+        if (V != std::trunc(V) || std::fabs(V) > 0x1p53)
+            return false;
+        Out = (int64_t)V;
+        return true;
+    };
+    int64_t StartInt = 0, StepInt = 1;
+    bool VarMutated = MutatedVars.count(VarName) != 0;
+    bool UseIntIV = !VarMutated && GetIntegralConst(Start, StartInt) &&
+                    (!Step || GetIntegralConst(Step, StepInt));
 
-    Value *StartVal = Start->codegen();
-    if (!StartVal)
-        return nullptr;
+    if (VarMutated) {
+        // 本体で代入されるループ変数はこれまで通りスタックスロットで回す
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, *VarName);
 
-    // Allocaに値を格納
-    Builder->CreateStore(StartVal, Alloca);
+        Value *StartVal = RequireScalar(Start->codegen(), "for start value must be a number");
+        if (!StartVal)
+            return nullptr;
 
-    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+        Builder->CreateStore(StartVal, Alloca);
 
-    // 現在のブロックからLoopBBへの明示的なフォールスルーを挿入する
-    Builder->CreateBr(LoopBB);
+        BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
 
-    Builder->SetInsertPoint(LoopBB);
+        // 現在のブロックからLoopBBへの明示的なフォールスルーを挿入する
+        Builder->CreateBr(LoopBB);
+        Builder->SetInsertPoint(LoopBB);
 
-    // シンボルテーブルに変数を導入(シャドーイング)
-    AllocaInst *OldVal = NamedValues[VarName];
-    NamedValues[VarName] = Alloca;
+        // シンボルテーブルに変数を導入(シャドーイングはスコープ破棄時に自動で復元される)
+        ScopedSymbolTable::Scope LoopScope(NamedValues);
+        NamedValues.insert(VarName, Alloca);
 
-    // Bodyのコード化
-    if (!Body->codegen())
-        return nullptr;
+        if (!Body->codegen())
+            return nullptr;
+
+        Value *StepVal = nullptr;
+        if (Step) {
+            StepVal = RequireScalar(Step->codegen(), "for step value must be a number");
+            if (!StepVal)
+                return nullptr;
+        } else {
+            StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+        }
 
-    // Stepのコード化
-    Value *StepVal = nullptr;
-    if (Step) {
-        StepVal = Step->codegen();
-        if (!StepVal)
+        Value *EndCondition = RequireScalar(End->codegen(), "for end condition must be a number");
+        if (!EndCondition)
             return nullptr;
+
+        Value *CurrentVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, VarName->c_str());
+        Value *NextVar = Builder->CreateFAdd(CurrentVar, StepVal, "nextvar");
+        Builder->CreateStore(NextVar, Alloca);
+
+        EndCondition = Builder->CreateFCmpONE(EndCondition, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+
+        BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+        BranchInst *Backedge = Builder->CreateCondBr(EndCondition, LoopBB, AfterBB);
+        AttachLoopMetadata(Backedge);
+        Builder->SetInsertPoint(AfterBB);
+
+        // forループのコード生成は常に0.0を返す
+        return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+    }
+
+    // 代入されないループ変数はphiで直接SSAとして回す(allocaとload/storeを作らない)
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    Type *I64Ty = Type::getInt64Ty(*TheContext);
+
+    Value *StartVal = nullptr;
+    if (!UseIntIV) {
+        StartVal = RequireScalar(Start->codegen(), "for start value must be a number");
+        if (!StartVal)
+            return nullptr;
+    }
+
+    BasicBlock *PreheaderBB = Builder->GetInsertBlock();
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+    Builder->CreateBr(LoopBB);
+    Builder->SetInsertPoint(LoopBB);
+
+    PHINode *IV;
+    Value *VarVal;
+    if (UseIntIV) {
+        // i64のphiで回し、本体にはsitofpした値を束縛する
+        IV = Builder->CreatePHI(I64Ty, 2, *VarName + ".iv");
+        IV->addIncoming(ConstantInt::get(I64Ty, StartInt), PreheaderBB);
+        VarVal = Builder->CreateSIToFP(IV, DoubleTy, *VarName);
     } else {
-        StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+        IV = Builder->CreatePHI(DoubleTy, 2, *VarName);
+        IV->addIncoming(StartVal, PreheaderBB);
+        VarVal = IV;
     }
 
-    Value *EndCondition = End->codegen();
-    if (!EndCondition)
+    ScopedSymbolTable::Scope LoopScope(NamedValues);
+    NamedValues.insert(VarName, VarVal);
+
+    if (!Body->codegen())
         return nullptr;
 
-    Value *CurrentVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, VarName.c_str());
-    Value *NextVar = Builder->CreateFAdd(CurrentVar, StepVal, "nextvar");
-    Builder->CreateStore(NextVar, Alloca);
+    Value *NextVar;
+    if (UseIntIV) {
+        NextVar = Builder->CreateAdd(IV, ConstantInt::get(I64Ty, StepInt), "nextvar");
+    } else {
+        Value *StepVal = nullptr;
+        if (Step) {
+            StepVal = RequireScalar(Step->codegen(), "for step value must be a number");
+            if (!StepVal)
+                return nullptr;
+        } else {
+            StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+        }
+        NextVar = Builder->CreateFAdd(IV, StepVal, "nextvar");
+    }
 
-    // ループの終了値を評価
-    // if/then/else文の条件評価と同じ
-    EndCondition = Builder->CreateFCmpONE(EndCondition, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+    // 終了条件は従来通りインクリメント前の値で評価される
+    // 整数IVで回っていて条件が「ループ変数 < 上限」の形なら、比較も整数で行う
+    // (ラッチがicmpになるとSCEVがトリップカウントを計算でき、ベクタライザと
+    // アンローラが働ける。fcmpのままだとループは解析不能になる)
+    // 整数iと実数bについて i < b ⇔ i < ceil(b) なので上限はceilしてから切り捨てる
+    // 切り捨てには飽和付きのllvm.fptosi.satを使う: 上限がi64の範囲を超えても
+    // poisonにならずINT64_MAXへ飽和し、「事実上無限」の挙動がfcmp時代と一致する
+    Value *EndCondition = nullptr;
+    auto *EndBin = dyn_cast<BinaryExprAST>(End);
+    if (UseIntIV && EndBin && EndBin->getOp() == '<') {
+        auto *EndLHS = dyn_cast<VariableExprAST>(EndBin->getLHS());
+        if (EndLHS && EndLHS->getName() == VarName) {
+            Value *Bound = RequireScalar(EndBin->getRHS()->codegen(), "for end condition must be a number");
+            if (!Bound)
+                return nullptr;
+            Value *IntBound = Builder->CreateIntrinsic(
+                    Intrinsic::fptosi_sat, {I64Ty, Bound->getType()},
+                    {Builder->CreateUnaryIntrinsic(Intrinsic::ceil, Bound)}, nullptr,
+                    "bound");
+            EndCondition = Builder->CreateICmpSLT(IV, IntBound, "loopcond");
+        }
+    }
+    if (!EndCondition) {
+        EndCondition = RequireScalar(End->codegen(), "for end condition must be a number");
+        if (!EndCondition)
+            return nullptr;
+        EndCondition = Builder->CreateFCmpONE(EndCondition, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+    }
 
-    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+    BasicBlock *LoopEndBB = Builder->GetInsertBlock();
+    IV->addIncoming(NextVar, LoopEndBB);
 
-    // 終了条件の値に基づいて、ループの再実行とループの終了のどちらかを選択する条件分岐を作成する
-    Builder->CreateCondBr(EndCondition, LoopBB, AfterBB);
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+    BranchInst *Backedge = Builder->CreateCondBr(EndCondition, LoopBB, AfterBB);
+    AttachLoopMetadata(Backedge);
     Builder->SetInsertPoint(AfterBB);
 
-    // ループ変数をシンボルテーブルから削除
-    if (OldVal)
-        NamedValues[VarName] = OldVal;
-    else
-        NamedValues.erase(VarName);
-
     // forループのコード生成は常に0.0を返す
     return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
 
 Value *VarExprAST::codegen() {
-    std::vector<AllocaInst *> OldBindings;
-
     Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
+    // このvar式で導入する束縛のスコープ(破棄時に旧束縛へ戻る)
+    ScopedSymbolTable::Scope VarScope(NamedValues);
+
+    // この式がヒープに確保した配列(本体の評価後にfreeする)
+    std::vector<Value *> HeapArrays;
+
     for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
-        const std::string &VarName = VarNames[i].first;
-        ExprAST *Init = VarNames[i].second.get();
+        Symbol VarName = VarNames[i].Name;
+        ExprAST *Init = VarNames[i].Init;
+
+        if (ExprAST *Size = VarNames[i].Size) {
+            Type *I64 = Type::getInt64Ty(*TheContext);
+            Value *Ptr;
+            if (auto *N = dyn_cast<NumberExprAST>(Size)) {
+                // 要素数が定数ならエントリブロックのallocaで連続バッファを確保する
+                double SizeVal = N->getVal();
+                if (SizeVal < 1 || SizeVal != std::trunc(SizeVal))
+                    return LogErrorV("array size must be a positive integer constant");
+                uint64_t Count = (uint64_t)SizeVal;
+                auto *ArrTy = ArrayType::get(Type::getDoubleTy(*TheContext), Count);
+                IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+                AllocaInst *Alloca = TmpB.CreateAlloca(ArrTy, nullptr, *VarName);
+                // スカラーのvarと同様、要素はすべて0で初期化する
+                Builder->CreateMemSet(Alloca, ConstantInt::get(Type::getInt8Ty(*TheContext), 0),
+                                      Count * sizeof(double), Alloca->getAlign());
+                Value *Zero = ConstantInt::get(I64, 0);
+                Value *Idx[] = {Zero, Zero};
+                Ptr = Builder->CreateInBoundsGEP(ArrTy, Alloca, Idx, *VarName + ".ptr");
+            } else {
+                // 要素数が実行時に決まる配列はヒープに確保し、スコープを抜けるときに解放する
+                Value *CountV = RequireScalar(Size->codegen(), "array size must be a number");
+                if (!CountV)
+                    return nullptr;
+                Value *Count = Builder->CreateFPToUI(CountV, I64, "arraysize");
+                FunctionCallee Calloc = TheModule->getOrInsertFunction(
+                        "calloc", FunctionType::get(Type::getInt8PtrTy(*TheContext), {I64, I64}, false));
+                Value *Raw = Builder->CreateCall(Calloc, {Count, ConstantInt::get(I64, sizeof(double))}, *VarName + ".mem");
+                HeapArrays.push_back(Raw);
+                Ptr = Builder->CreateBitCast(Raw, Type::getDoubleTy(*TheContext)->getPointerTo(), *VarName);
+            }
+            // 配列はdouble*として束縛される(参照はポインタを返し、a[i]がGEPになる)
+            NamedValues.insert(VarName, Ptr);
+            continue;
+        }
 
-        // イニシャライザを発行
+        // イニシャライザを発行(doubleのほかsplat()などのベクトル値でも初期化できる)
         Value *InitVal;
         if (Init) {
             InitVal = Init->codegen();
             if (!InitVal)
                 return nullptr;
+            if (InitVal->getType()->isPointerTy())
+                return LogErrorV("cannot initialize a variable with an array");
         } else {
             InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
         }
 
-        // Allocaを作成
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-        Builder->CreateStore(InitVal, Alloca);
-
-        OldBindings.push_back(NamedValues[VarName]);
-        // シンボルテーブルを更新
-        NamedValues[VarName] = Alloca;
+        if (MutatedVars.count(VarName)) {
+            // 代入される変数だけallocaを作る(mem2regに消してもらうIRを最初から作らない)
+            AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, *VarName, InitVal->getType());
+            Builder->CreateStore(InitVal, Alloca);
+            NamedValues.insert(VarName, Alloca);
+        } else {
+            // 直接SSA束縛
+            NamedValues.insert(VarName, InitVal);
+        }
     }
 
     Value *BodyVal = Body->codegen();
     if (!BodyVal)
         return nullptr;
 
-    // 以前の変数に戻す
-    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-        NamedValues[VarNames[i].first] = OldBindings[i];
+    // ヒープ配列は本体の値を計算し終えてから解放する
+    if (!HeapArrays.empty()) {
+        FunctionCallee Free = TheModule->getOrInsertFunction(
+                "free", FunctionType::get(Type::getVoidTy(*TheContext),
+                                          {Type::getInt8PtrTy(*TheContext)}, false));
+        for (Value *Raw: HeapArrays)
+            Builder->CreateCall(Free, Raw);
+    }
 
     return BodyVal;
 }
 
 Function *PrototypeAST::codegen() {
-    // LLVM double型のN個のベクトルを作成する
-    std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
+    // 引数型のリストを作成する(スカラーはdouble、配列はdouble*、ベクトルは<4 x double>)
+    std::vector<Type*> ParamTypes;
+    ParamTypes.reserve(Args.size());
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+        switch (getArgKind(i)) {
+            case ak_array:
+                ParamTypes.push_back(Type::getDoubleTy(*TheContext)->getPointerTo());
+                break;
+            case ak_vector:
+                ParamTypes.push_back(VecTy());
+                break;
+            default:
+                ParamTypes.push_back(Type::getDoubleTy(*TheContext));
+                break;
+        }
+    }
     // 与えられたプロトタイプに対して使用されるべきFunctionTypeを作成する。false=可変長引数ではない。型は定数なのでgetになる
-    FunctionType *FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+    FunctionType *FT = FunctionType::get(Type::getDoubleTy(*TheContext), ParamTypes, false);
     // プロトタイプに対応するIR Functionを作成する。使用する型、リンク、名前と、どのモジュールに挿入するかを示す
     // ExternalLinkage=関数が現在のモジュールの外部で定義され、かつ、モジュールの外部の関数から呼び出される可能性があることを意味する
     // TheModuleのシンボルテーブルに登録される
-    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+    Function *F = Function::Create(FT, Function::ExternalLinkage, *Name, TheModule.get());
 
     // 各引数の名前を、Prototypeで与えられた名前に従って設定する
     unsigned Idx = 0;
     for (auto &Arg: F->args())
-        Arg.setName(Args[Idx++]);
+        Arg.setName(*Args[Idx++]);
+
+    // JITモードではKaleidoscope内で定義される関数をfastccにする
+    // (呼び出し側のtailマークと合わせるとバックエンドのsibcall最適化が
+    // 相互再帰でも末尾呼び出しへ落とす。自己再帰はTailCallElimがループ化する)
+    // __anon_exprはホストがC関数ポインタとして呼ぶため、externと同様にCのまま
+    // AOTモードもCのまま(出力したオブジェクトはtest.cppのようなC/C++から呼ばれる)
+    if (UseJIT && !IsExtern && *Name != "__anon_expr")
+        F->setCallingConv(CallingConv::Fast);
 
     return F;
 }
 
+// 関数内のAlwaysInline付き呼び出し(ユーザー定義演算子)をその場でインライン展開する
+// AlwaysInlinerはモジュールパスなので、関数単位のコンパイルの流れに合わせてここで直接InlineFunctionを呼ぶ
+static void InlineAlwaysInlineCalls(Function *F) {
+    // 再帰的な演算子定義で展開が止まらなくなるのを防ぐ上限
+    unsigned Budget = 64;
+    bool Changed = true;
+    while (Changed && Budget) {
+        Changed = false;
+        for (BasicBlock &BB: *F) {
+            for (Instruction &I: BB) {
+                auto *CI = dyn_cast<CallInst>(&I);
+                if (!CI)
+                    continue;
+                Function *Callee = CI->getCalledFunction();
+                if (!Callee || Callee->isDeclaration() || Callee == F || !Callee->hasFnAttribute(Attribute::AlwaysInline))
+                    continue;
+                InlineFunctionInfo IFI;
+                if (InlineFunction(*CI, IFI).isSuccess()) {
+                    // イテレータが無効になるのでブロック走査をやり直す
+                    Changed = true;
+                    --Budget;
+                    break;
+                }
+            }
+            if (Changed)
+                break;
+        }
+    }
+}
+
 Function *FunctionAST::codegen() {
+    // AOTでは全トップレベル式が1つのモジュールに共存するため、固定名の
+    // __anon_exprを連番で一意化する(同名の2個目以降が既存関数の後ろへ
+    // 到達不能ブロックとして追記され、出力から黙って消えるのを防ぐ)
+    // JITは式ごとにモジュールを回収するので固定名のままでよい
+    if (!UseJIT && *Proto->getName() == "__anon_expr") {
+        static unsigned AnonCounter = 0;
+        Proto = std::make_unique<PrototypeAST>(
+                TheInterner.intern("__anon_expr" + std::to_string(AnonCounter++)),
+                std::vector<Symbol>());
+    }
+
+    TimeTraceScope TimeScope("codegen", *getProtoName());
+
+    // IRを作る前にAST上で定数を畳み込む
+    Body = Body->fold();
+
     auto &P = *Proto;
+    // 先にexternで宣言されていた関数は、既存の呼び出し箇所とIRの宣言がC呼び出し
+    // 規約になっているため、定義もC規約のままにする(fastccにすると規約が食い違う)
+    auto Existing = FunctionProtos.find(Proto->getName());
+    if (Existing != FunctionProtos.end() && Existing->second->isExtern())
+        Proto->markExtern();
     FunctionProtos[Proto->getName()] = std::move(Proto);
     Function *TheFunction = getFunction(P.getName());
 
@@ -961,41 +2571,91 @@ Function *FunctionAST::codegen() {
 //    if (!TheFunction->empty())
 //        return (Function *)LogErrorV("Function cannot be redefined");
 
-    // ユーザー定義演算子の場合、優先順位表に登録する
-    if (P.isBinaryOperator())
-        BinaryOperatorPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+    // ユーザー定義演算子は内部ループの式中に大量に現れるため、呼び出しコストを払わないよう常にインライン展開する
+    if (P.isBinaryOperator() || P.isUnaryOperator())
+        TheFunction->addFnAttr(Attribute::AlwaysInline);
 
     BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
     Builder->SetInsertPoint(BB);
 
+    // 階層型JIT: 関数入口に実行回数カウンタを挿入する
+    // しきい値にちょうど達した1回だけランタイムフックを呼び、O3再コンパイル対象として通知する
+    // 演算子定義は呼び出し側へ常にインライン展開されるため対象外
+    if (UseJIT && !P.isBinaryOperator() && !P.isUnaryOperator() && *P.getName() != "__anon_expr") {
+        Type *I64 = Type::getInt64Ty(*TheContext);
+        auto *Counter = new GlobalVariable(*TheModule, I64, false, GlobalValue::InternalLinkage,
+                                           ConstantInt::get(I64, 0), "__hotcnt." + *P.getName());
+        Value *Count = Builder->CreateLoad(I64, Counter, "hotcnt");
+        Value *Next = Builder->CreateAdd(Count, ConstantInt::get(I64, 1), "hotcnt.next");
+        Builder->CreateStore(Next, Counter);
+        Value *IsHot = Builder->CreateICmpEQ(Next, ConstantInt::get(I64, HotThreshold), "ishot");
+
+        BasicBlock *HotBB = BasicBlock::Create(*TheContext, "hot", TheFunction);
+        BasicBlock *ContBB = BasicBlock::Create(*TheContext, "cont", TheFunction);
+        Builder->CreateCondBr(IsHot, HotBB, ContBB);
+
+        Builder->SetInsertPoint(HotBB);
+        FunctionCallee MarkHot = TheModule->getOrInsertFunction(
+            "kaleidoscope_mark_hot",
+            FunctionType::get(Type::getVoidTy(*TheContext),
+                              {Type::getInt8PtrTy(*TheContext)}, false));
+        Builder->CreateCall(MarkHot, Builder->CreateGlobalStringPtr(*P.getName()));
+        Builder->CreateBr(ContBB);
+        Builder->SetInsertPoint(ContBB);
+    }
+
+    // 本体中で代入される変数を先に調べ、それ以外はalloca/load/storeを介さず直接SSA値に束縛する
+    MutatedVars.clear();
+    Body->collectAssignedVars(MutatedVars);
+
     // NamedValuesに引数を保存(VariableExprASTノードからアクセスできるようにする)
     NamedValues.clear();
+    unsigned ArgIdx = 0;
     for (auto &Arg: TheFunction->args()) {
-        // 変数のAllocaを作成
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
-
-        Builder->CreateStore(&Arg, Alloca);
-
-        NamedValues[std::string(Arg.getName())] = Alloca;
+        Symbol ArgSym = P.getArgs()[ArgIdx++];
+        if (Arg.getType()->isPointerTy()) {
+            // 配列引数はポインタのまま束縛する(a[i]がGEPの基底になる)
+            NamedValues.insert(ArgSym, &Arg);
+        } else if (MutatedVars.count(ArgSym)) {
+            // 変数のAllocaを作成(ベクトル引数ならベクトル型のまま)
+            AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName(), Arg.getType());
+            Builder->CreateStore(&Arg, Alloca);
+            NamedValues.insert(ArgSym, Alloca);
+        } else {
+            NamedValues.insert(ArgSym, &Arg);
+        }
     }
 
-    if (Value *RetVal = Body->codegen()) {
+    if (Value *RetVal = RequireScalar(Body->codegen(), "function body must evaluate to a number")) {
         Builder->CreateRet(RetVal);
 
+        // ユーザー定義演算子の呼び出しを展開してから最適化に回す
+        InlineAlwaysInlineCalls(TheFunction);
+
         // 生成されたコードに対して様々な整合性チェックを行い、コンパイラが正しく動作しているかどうかを判断する
         verifyFunction(*TheFunction);
 
-        // 関数の最適化
-        TheFunctionPassManager->run(*TheFunction);
+        // 最適化前の時点で、この関数が生成したIRの量を記録する
+        TheStats.count(TheStats.FunctionsCompiled);
+        TheStats.count(TheStats.IRBasicBlocks, TheFunction->size());
+        uint64_t NumInsts = 0;
+        for (const BasicBlock &BB: *TheFunction)
+            NumInsts += BB.size();
+        TheStats.count(TheStats.IRInstructions, NumInsts);
+
+        // 関数の最適化(O0では素通し)
+        if (OptLevel != OptimizationLevel::O0) {
+            TimeTraceScope PassScope("function passes", *P.getName());
+            TheFPM->run(*TheFunction, *TheFAM);
+        }
 
         return TheFunction;
     }
 
     // エラー処理
+    // 作りかけの関数をモジュールから消すため、メモ化済みの解決結果も道連れにする
+    ResolvedFunctions.erase(P.getName());
     TheFunction->eraseFromParent();
-
-    if (P.isBinaryOperator())
-        BinaryOperatorPrecedence.erase(P.getOperatorName());
     return nullptr;
 }
 
@@ -1003,102 +2663,507 @@ Function *FunctionAST::codegen() {
 // Top-Level parsing and JIT Driver
 //===----------------------------------------------------------------------===//
 
+// バッファ付き出力ランタイムのflush(後方のライブラリ節で定義される)
+extern "C" double flushd();
+
 static void InitializeModuleAndPassManager() {
+    // 旧モジュールのFunction*はすべて無効になるので、メモ化した解決結果を世代ごと捨てる
+    ++ResolvedFunctionsGeneration;
+    // 旧モジュールは旧コンテキストが生きているうちに破棄する(再初期化時)
+    TheModule.reset();
     TheContext = std::make_unique<LLVMContext>();
+    // ベクタル化ヒントはコンパイラが自動で付与するため、変換できなかった
+    // ループごとに出る警告や最適化リマークは抑制し、エラーだけ表示する
+    TheContext->setDiagnosticHandlerCallBack(
+            [](const DiagnosticInfo &DI, void *) {
+                if (DI.getSeverity() != DS_Error)
+                    return;
+                DiagnosticPrinterRawOStream DP(errs());
+                errs() << "error: ";
+                DI.print(DP);
+                errs() << "\n";
+            });
     TheModule = std::make_unique<Module>("my cool jit", *TheContext);
-//    TheModule->setDataLayout(TheJIT->getDataLayout());
+    TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().getTriple());
+    if (UseJIT)
+        TheModule->setDataLayout(TheJIT->getDataLayout());
+    else
+        TheModule->setDataLayout(TheTargetMachine->createDataLayout());
 
     Builder = std::make_unique<IRBuilder<>>(*TheContext);
 
-    TheFunctionPassManager = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+    // 新PassManagerの解析マネージャ一式を構築する
+    TheLAM = std::make_unique<LoopAnalysisManager>();
+    TheFAM = std::make_unique<FunctionAnalysisManager>();
+    TheCGAM = std::make_unique<CGSCCAnalysisManager>();
+    TheMAM = std::make_unique<ModuleAnalysisManager>();
+
+    PassBuilder PB(TheTargetMachine);
+    PB.registerModuleAnalyses(*TheMAM);
+    PB.registerCGSCCAnalyses(*TheCGAM);
+    PB.registerFunctionAnalyses(*TheFAM);
+    PB.registerLoopAnalyses(*TheLAM);
+    PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+
+    // 関数単位の簡約パイプライン(mem2reg/InstCombine/GVN等を含む)
+    // O0のときは何も回さない
+    // JITモードでは起動を速くするため初回コンパイルをO1に抑える
+    // (ホットと判明した関数だけが後からO3で再コンパイルされる)
+    OptimizationLevel Tier0 = OptLevel;
+    if (UseJIT && OptLevel != OptimizationLevel::O0)
+        Tier0 = OptimizationLevel::O1;
+    TheFPM = std::make_unique<FunctionPassManager>();
+    if (Tier0 != OptimizationLevel::O0) {
+        *TheFPM = PB.buildFunctionSimplificationPipeline(Tier0, ThinOrFullLTOPhase::None);
+        // 自己再帰の末尾呼び出しを必ずループへ変換する
+        // (深い再帰でのスタックオーバーフロー対策なので、パイプライン任せにしない)
+        TheFPM->addPass(TailCallElimPass());
+    }
+}
+
+// 指定されたモジュール全体へフルパイプラインをかける
+// O2/O3ではループベクタライザ・SLPベクタライザもここで走る
+static void RunModulePipeline(Module &M, OptimizationLevel Level) {
+    PassBuilder PB(TheTargetMachine);
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM = Level == OptimizationLevel::O0
+        ? PB.buildO0DefaultPipeline(Level)
+        : PB.buildPerModuleDefaultPipeline(Level);
+    MPM.run(M, MAM);
+}
 
-    TheFunctionPassManager->add(createPromoteMemoryToRegisterPass());
-    TheFunctionPassManager->add(createInstructionCombiningPass());
-    TheFunctionPassManager->add(createReassociatePass());
-    TheFunctionPassManager->add(createGVNPass());
-    TheFunctionPassManager->add(createCFGSimplificationPass());
-    TheFunctionPassManager->doInitialization();
+// オブジェクト出力前に呼ぶラッパー
+static void OptimizeModule() {
+    TimeTraceScope TimeScope("module optimization");
+    RunModulePipeline(*TheModule, OptLevel);
 }
 
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
+//===----------------------------------------------------------------------===//
+// Precompiled prelude (bitcode)
+//===----------------------------------------------------------------------===//
+
+// -emit-prelude=用: ユーザー定義二項演算子の優先順位をモジュールの
+// 名前付きメタデータへ記録する(関数シグネチャからは復元できない唯一の情報)
+static void RecordOperatorPrecedences(Module &M) {
+    // ハッシュ表の列挙順に依存しないよう、演算子名で整列してから書き出す
+    // (ビットコードを決定的にしてオブジェクトキャッシュのキーを安定させる)
+    std::vector<std::pair<char, unsigned>> Operators;
+    for (const auto &Entry: FunctionProtos) {
+        const PrototypeAST &Proto = *Entry.second;
+        if (Proto.isBinaryOperator())
+            Operators.emplace_back(Proto.getOperatorName(), Proto.getBinaryPrecedence());
+    }
+    std::sort(Operators.begin(), Operators.end());
+    NamedMDNode *NMD = nullptr;
+    for (const auto &Op: Operators) {
+        if (!NMD)
+            NMD = M.getOrInsertNamedMetadata("kaleidoscope.binop.precedence");
+        LLVMContext &Ctx = M.getContext();
+        Metadata *Ops[] = {
+                MDString::get(Ctx, std::string(1, Op.first)),
+                ConstantAsMetadata::get(ConstantInt::get(
+                        Type::getInt32Ty(Ctx), Op.second))};
+        NMD->addOperand(MDNode::get(Ctx, Ops));
+    }
+}
+
+// 遅延マテリアライズ中のモジュールはビットコードのバッファを参照し続けるため、
+// プログラム終了まで生かしておく
+static std::unique_ptr<MemoryBuffer> PreludeBuffer;
+
+// -prelude=で指定されたビットコードを起動時に読み込む
+// 関数本体は遅延マテリアライズのまま保持し、JITではモジュールごとCODレイヤへ
+// 渡すので、実際のパース・コンパイルは各関数の初回呼び出し時まで起きない
+// (オブジェクトキャッシュと併用すれば初回呼び出しのコンパイルも省ける)。
+// プロトタイプはIRのシグネチャから直接復元してFunctionProtosへ登録するため、
+// プレリュードのソースをパーサーへ通し直す必要はない
+static bool LoadPrelude(const char *Path) {
+    TimeTraceScope TimeScope("load prelude", Path);
+    auto BufOrErr = MemoryBuffer::getFile(Path);
+    if (!BufOrErr) {
+        fprintf(stderr, "Error: could not open prelude '%s'\n", Path);
+        return false;
+    }
+    PreludeBuffer = std::move(*BufOrErr);
+
+    // JITでは独立したコンテキストへ読み込み、モジュールごとJITへ所有させる
+    // AOTでは出力モジュールと同じコンテキストへ読み込んで直接リンクする
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto ModOrErr = getLazyBitcodeModule(PreludeBuffer->getMemBufferRef(),
+                                         UseJIT ? *Ctx : *TheContext);
+    if (!ModOrErr) {
+        logAllUnhandledErrors(ModOrErr.takeError(), errs(), "Error: ");
+        return false;
+    }
+    std::unique_ptr<Module> M = std::move(*ModOrErr);
+
+    // ユーザー定義演算子の優先順位をメタデータから取り出す
+    if (NamedMDNode *NMD = M->getNamedMetadata("kaleidoscope.binop.precedence")) {
+        for (const MDNode *N: NMD->operands()) {
+            if (N->getNumOperands() != 2)
+                continue;
+            StringRef OpName = cast<MDString>(N->getOperand(0))->getString();
+            auto *Prec = mdconst::extract<ConstantInt>(N->getOperand(1));
+            if (!OpName.empty())
+                PreludeOperators.emplace_back(OpName[0], (int)Prec->getZExtValue());
+        }
+    }
+
+    // 各関数のプロトタイプをシグネチャから組み立てる
+    // 引数型がそのまま渡し方を表す(double=スカラー、double*=配列、ベクトル=SIMD)
+    for (Function &F: *M) {
+        StringRef FnName = F.getName();
+        // 内部ヘルパー(__pforラッパ等)とイントリンシックは言語からは見えない
+        if (F.isIntrinsic() || FnName.startswith("__"))
+            continue;
+        std::vector<Symbol> ArgNames;
+        std::vector<PrototypeAST::ArgKind> ArgKinds;
+        bool Representable = F.getReturnType()->isDoubleTy();
+        unsigned Idx = 0;
+        for (const Argument &Arg: F.args()) {
+            Type *Ty = Arg.getType();
+            if (Ty->isDoubleTy())
+                ArgKinds.push_back(PrototypeAST::ak_scalar);
+            else if (Ty->isPointerTy())
+                ArgKinds.push_back(PrototypeAST::ak_array);
+            else if (Ty->isVectorTy())
+                ArgKinds.push_back(PrototypeAST::ak_vector);
+            else {
+                Representable = false;
+                break;
+            }
+            // ビットコードには引数名が残っているのでそのまま使う(無ければ補う)
+            std::string ArgName = Arg.getName().str();
+            if (ArgName.empty())
+                ArgName = "arg" + std::to_string(Idx);
+            ArgNames.push_back(TheInterner.intern(ArgName));
+            ++Idx;
+        }
+        // 言語の型体系で表せない関数は登録しない(呼べないだけで、リンクは通る)
+        if (!Representable)
+            continue;
+        bool IsOperator = (FnName.size() == 7 && FnName.startswith("binary")) ||
+                          (FnName.size() == 6 && FnName.startswith("unary"));
+        unsigned Precedence = 0;
+        for (const auto &Op: PreludeOperators)
+            if (IsOperator && Op.first == FnName.back())
+                Precedence = (unsigned)Op.second;
+        Symbol Name = TheInterner.intern(std::string_view(FnName.data(), FnName.size()));
+        auto Proto = std::make_unique<PrototypeAST>(Name, std::move(ArgNames),
+                                                    IsOperator, Precedence,
+                                                    std::move(ArgKinds));
+        // プレリュード内の定義はC呼び出し規約のままなので、以降のセッションから
+        // の呼び出しもextern扱いでC規約に合わせる
+        if (F.getCallingConv() == CallingConv::C)
+            Proto->markExtern();
+        FunctionProtos[Name] = std::move(Proto);
+    }
+
+    if (UseJIT) {
+        M->setDataLayout(TheJIT->getDataLayout());
+        // CODレイヤはパーティション切り出しでモジュールを別コンテキストへ
+        // クローンするため、渡す前にIRをマテリアライズしておく必要がある
+        // (ここまでの処理はシンボル表だけで済んでいる)。コンパイルは
+        // 引き続き遅延で、各関数の初回呼び出し時にしか走らない
+        ExitOnErr(M->materializeAll());
+        ExitOnErr(TheJIT->addModule(
+                orc::ThreadSafeModule(std::move(M), std::move(Ctx))));
+    } else {
+        // AOTでは出力モジュールへそのままリンクする(ここで全体がマテリアライズされる)
+        if (Linker(*TheModule).linkInModule(std::move(M))) {
+            fprintf(stderr, "Error: failed to link prelude '%s'\n", Path);
+            return false;
+        }
+    }
+    return true;
+}
+
+// しきい値に達した関数をO3で再コンパイルし、ホット用dylibへ差し替える
+// 呼び出し先の定義もビットコードからリンクして、O3のインライナから見えるようにする
+static void RecompileHotFunctions() {
+    std::vector<std::string> Names;
+    {
+        std::lock_guard<std::mutex> Guard(HotMutex);
+        Names.swap(PendingHotNames);
+    }
+
+    for (const std::string &NameStr: Names) {
+        Symbol Name = TheInterner.intern(NameStr);
+        if (!RecompiledHot.insert(Name).second)
+            continue;
+        auto BCIt = FunctionBitcode.find(Name);
+        if (BCIt == FunctionBitcode.end())
+            continue;
+
+        TimeTraceScope TimeScope("hot recompile", *Name);
+
+        auto Ctx = std::make_unique<LLVMContext>();
+        auto ModOrErr = parseBitcodeFile(
+            MemoryBufferRef(BCIt->second, *Name), *Ctx);
+        if (!ModOrErr) {
+            consumeError(ModOrErr.takeError());
+            continue;
+        }
+        auto Mod = std::move(*ModOrErr);
+
+        // 直接呼び出している関数の定義をリンクする(1段のみ)
+        // リンクは関数リストを書き換えるため、宣言の列挙を先に済ませておく
+        std::vector<Symbol> Callees;
+        for (Function &F: *Mod) {
+            if (!F.isDeclaration() || F.isIntrinsic())
+                continue;
+            Symbol CalleeName = TheInterner.intern(
+                std::string_view(F.getName().data(), F.getName().size()));
+            if (CalleeName != Name && FunctionBitcode.count(CalleeName))
+                Callees.push_back(CalleeName);
+        }
+        Linker ModLinker(*Mod);
+        std::vector<Symbol> Linked;
+        for (Symbol CalleeName: Callees) {
+            auto CalleeMod = parseBitcodeFile(
+                MemoryBufferRef(FunctionBitcode[CalleeName], *CalleeName), *Ctx);
+            if (!CalleeMod) {
+                consumeError(CalleeMod.takeError());
+                continue;
+            }
+            if (!ModLinker.linkInModule(std::move(*CalleeMod)))
+                Linked.push_back(CalleeName);
+        }
+        // リンクした呼び出し先はこのモジュールの外へ公開しない
+        // (呼び出し先自身が後からホットになったときのシンボル重複を避ける)
+        for (Function &F: *Mod)
+            if (!F.isDeclaration() && F.getName() != *Name)
+                F.setLinkage(GlobalValue::InternalLinkage);
+
+        RunModulePipeline(*Mod, OptimizationLevel::O3);
+        ExitOnErr(TheJIT->addHotModule(
+            orc::ThreadSafeModule(std::move(Mod), std::move(Ctx))));
+        if (Interactive)
+            fprintf(stderr, "[jit] recompiled %s at O3 (%zu callees linked in)\n",
+                    Name->c_str(), Linked.size());
+    }
+}
+
+static void HandleDefinition(Parser &P) {
+    auto FnAST = [&P] {
+        TimeTraceScope TimeScope("parse definition");
+        return P.ParseDefinition();
+    }();
+    if (FnAST) {
+        // codegen()がProtoをFunctionProtosへ移動するため、名前は先に取っておく
+        Symbol FnName = FnAST->getProtoName();
         if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Read function definition:\n");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            // ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-            // InitializeModuleAndPassManager();
+            // IRダンプはstderrへのI/Oだけでバッチコンパイルの実時間を倍にするため、対話時のみ
+            if (Interactive) {
+                fprintf(stderr, "Read function definition:\n");
+                FnIR->print(errs());
+                fprintf(stderr, "\n");
+            }
+            if (UseJIT) {
+                // この定義のビットコードを保存しておく(ホット時のO3再コンパイル元)
+                std::string Bitcode;
+                {
+                    raw_string_ostream OS(Bitcode);
+                    WriteBitcodeToFile(*TheModule, OS);
+                }
+                FunctionBitcode[FnName] = std::move(Bitcode);
+                // モジュールごとJITへ移す(実際の機械語化は最初の呼び出しまで遅延される)
+                ExitOnErr(TheJIT->addModule(orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+                InitializeModuleAndPassManager();
+            }
         }
     } else {
-        getNextToken();
+        P.getNextToken();
     }
+    // この定義のASTノードをまとめて解放
+    P.arena().reset();
 }
 
-static void HandleExtern() {
-    if (auto ProtoAST = ParseExtern()) {
+static void HandleExtern(Parser &P) {
+    auto ProtoAST = [&P] {
+        TimeTraceScope TimeScope("parse extern");
+        return P.ParseExtern();
+    }();
+    if (ProtoAST) {
         if (auto *FnIR = ProtoAST->codegen()) {
-            fprintf(stderr, "Read extern:\n");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
+            if (Interactive) {
+                fprintf(stderr, "Read extern:\n");
+                FnIR->print(errs());
+                fprintf(stderr, "\n");
+            }
             FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
         }
     } else {
-        getNextToken();
+        P.getNextToken();
+    }
+}
+
+// 定数だけからなるトップレベル式(数値リテラル・組み込み二項演算子・if)を
+// ASTのまま評価するREPL用の近道。IR関数の生成、検証、最適化パス、JITの
+// ルックアップをすべて省けるため、1+2;のような式の応答が桁違いに速くなる
+// 変数・関数呼び出し・ユーザー定義演算子が現れたらfalseを返し、通常の
+// codegen/JIT経路へフォールバックする(ifは選ばれた側の枝だけ評価する)
+static bool InterpretConstExpr(const ExprAST *E, double &Out) {
+    switch (E->getKind()) {
+        case ExprAST::ek_number:
+            Out = cast<NumberExprAST>(E)->getVal();
+            return true;
+        case ExprAST::ek_binary: {
+            const auto *B = cast<BinaryExprAST>(E);
+            double L, R;
+            if (!InterpretConstExpr(B->getLHS(), L) || !InterpretConstExpr(B->getRHS(), R))
+                return false;
+            switch (B->getOp()) {
+                case '+': Out = L + R; return true;
+                case '-': Out = L - R; return true;
+                case '*': Out = L * R; return true;
+                case '<': Out = L < R ? 1.0 : 0.0; return true;
+                default: return false; // ユーザー定義演算子は実行時の定義に従う
+            }
+        }
+        case ExprAST::ek_if: {
+            const auto *I = cast<IfExprAST>(E);
+            double Condition;
+            if (!InterpretConstExpr(I->getCondition(), Condition))
+                return false;
+            return InterpretConstExpr(Condition != 0.0 ? I->getThen() : I->getElse(), Out);
+        }
+        default:
+            return false;
     }
 }
 
-static void HandleTopLevelExpression() {
-    if (auto FnAST = ParseTopLevelExpr()) {
-        FnAST->codegen();
-//        if (auto *FnIR = FnAST->codegen()) {
-//            fprintf(stderr, "Read top level expression:\n");
-//            FnIR->print(errs());
-//            fprintf(stderr, "\n");
-//
-//            auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-//
-//            auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-//            ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-//            // 後続のコードを格納する新しいモジュールを追加
-//            InitializeModuleAndPassManager();
-//
-//            // 最終的に生成されるコードへのポインタを取得
-//            auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-//
-//            // 関数のメモリ内アドレスを取得
-//            double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-//            // 結果ポインタをその型の関数ポインタにキャストして直接呼び出すだけで良い(JITコンパイルされたコードと、アプリケーションに静的にリンクされたネイティブのマシンコードとの間に差はない)
-//            fprintf(stderr, "Evaluated to %f\n", FP());
-//
-//            ExitOnErr(RT->remove());
-//        }
+static void HandleTopLevelExpression(Parser &P) {
+    auto FnAST = [&P] {
+        TimeTraceScope TimeScope("parse top-level expr");
+        return P.ParseTopLevelExpr();
+    }();
+    if (FnAST) {
+        // 定数式はJITを経由せずその場で評価する(AOTでは式もオブジェクトに入るため対象外)
+        double Result;
+        if (UseJIT && InterpretConstExpr(FnAST->getBody(), Result)) {
+            fprintf(stderr, "Evaluated to %f\n", Result);
+            P.arena().reset();
+            return;
+        }
+
+        Symbol AnonName = FnAST->getProtoName();
+        if (auto *FnIR = FnAST->codegen()) {
+            if (UseJIT) {
+                // この式のIR・オブジェクトコード・シンボルをまとめて回収できるよう、専用のResourceTrackerに載せる
+                auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+
+                auto TSM = orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+                // 1回実行して捨てるコードなので遅延レイヤを経由させず即時コンパイルする
+                ExitOnErr(TheJIT->addEagerModule(std::move(TSM), RT));
+                // 後続のコードを格納する新しいモジュールを追加
+                InitializeModuleAndPassManager();
+
+                // 最終的に生成されるコードへのポインタを取得
+                auto ExprSymbol = ExitOnErr(TheJIT->lookup(*AnonName));
+
+                // 関数のメモリ内アドレスを取得
+                double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+                // 結果ポインタをその型の関数ポインタにキャストして直接呼び出すだけで良い(JITコンパイルされたコードと、アプリケーションに静的にリンクされたネイティブのマシンコードとの間に差はない)
+                double Result = FP();
+                // スクリプトの出力が結果表示の後に化けて出ないよう、先に書き出す
+                flushd();
+                fprintf(stderr, "Evaluated to %f\n", Result);
+
+                // 結果を出力したら、この式に属するリソースを即座に解放する
+                // 長時間のREPLセッションでモジュールとJITの状態が際限なく成長しないために必須
+                ExitOnErr(RT->remove());
+                FunctionProtos.erase(AnonName);
+            }
+            (void)FnIR;
+        }
     } else {
-        getNextToken();
+        P.getNextToken();
     }
+    P.arena().reset();
 }
 
-static void MainLoop() {
+static void MainLoop(Parser &P) {
     while (true) {
-        fprintf(stderr, "ready> ");
-        switch (CurrentToken) {
+        // 直前の評価でしきい値に達した関数があれば、次の入力の前に再コンパイルする
+        if (UseJIT)
+            RecompileHotFunctions();
+        if (Interactive)
+            fprintf(stderr, "ready> ");
+        switch (P.current()) {
             case token_eof:
                 return;
             case ';':
-                getNextToken();
+                P.getNextToken();
                 break;
             case token_def:
-                HandleDefinition();
+                HandleDefinition(P);
                 break;
             case token_extern:
-                HandleExtern();
+                HandleExtern(P);
                 break;
             default:
-                HandleTopLevelExpression();
+                HandleTopLevelExpression(P);
                 break;
         }
     }
 }
 
+// パーサースレッドとコード生成スレッドをつなぐ有界キュー
+// パーサーが先行しすぎてASTを溜め込みすぎないよう容量で抑える
+class ItemQueue {
+    static constexpr size_t Capacity = 64;
+    std::mutex Lock;
+    std::condition_variable NotEmpty, NotFull;
+    std::deque<Parser::Item> Items;
+    bool Closed = false;
+
+public:
+    void push(Parser::Item Item) {
+        std::unique_lock<std::mutex> Guard(Lock);
+        NotFull.wait(Guard, [this] { return Items.size() < Capacity; });
+        Items.push_back(std::move(Item));
+        NotEmpty.notify_one();
+    }
+
+    // プロデューサ側の終了通知(以降popは残りを吐き出してfalseを返す)
+    void close() {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Closed = true;
+        NotEmpty.notify_one();
+    }
+
+    bool pop(Parser::Item &Item) {
+        std::unique_lock<std::mutex> Guard(Lock);
+        NotEmpty.wait(Guard, [this] { return !Items.empty() || Closed; });
+        if (Items.empty())
+            return false;
+        Item = std::move(Items.front());
+        Items.pop_front();
+        NotFull.notify_one();
+        return true;
+    }
+};
+
+// パース済みのトップレベル項目1つをコード生成する(バッチモード用)
+static void CodegenParsedItem(Parser::Item &Item) {
+    if (Item.FnAST) {
+        Item.FnAST->codegen();
+    } else if (Item.ProtoAST) {
+        if (Item.ProtoAST->codegen())
+            FunctionProtos[Item.ProtoAST->getName()] = std::move(Item.ProtoAST);
+    }
+}
+
 //===----------------------------------------------------------------------===//
 // "Library" functions that can be "extern'd" from user code.
 //===----------------------------------------------------------------------===//
@@ -1109,69 +3174,762 @@ static void MainLoop() {
 #define DLLEXPORT
 #endif
 
+// バッファ付き出力ランタイム
+// 値1つごとにfputc/fprintfを呼ぶと出力の多いスクリプトでは書き込みが
+// 支配的になるため、追記はメモリ上のバッファへのコピーだけにし、バッファが
+// 一杯になるか、評価結果の表示や終了の直前にまとめて書き出す
+// parallel_forのワーカーからも呼ばれるためロックで守る
+namespace {
+
+constexpr size_t OutputBufferCap = 1 << 16;
+std::mutex OutputLock;
+char OutputBuffer[OutputBufferCap];
+size_t OutputUsed = 0;
+
+// OutputLockを保持した状態で呼ぶ
+void flushOutputLocked() {
+    if (OutputUsed) {
+        fwrite(OutputBuffer, 1, OutputUsed, stderr);
+        OutputUsed = 0;
+    }
+}
+
+// OutputLockを保持した状態で呼ぶ
+void appendOutputLocked(const char *Data, size_t Len) {
+    if (OutputUsed + Len > OutputBufferCap)
+        flushOutputLocked();
+    if (Len > OutputBufferCap) {
+        // バッファより大きい書き込みはそのまま通す
+        fwrite(Data, 1, Len, stderr);
+        return;
+    }
+    memcpy(OutputBuffer + OutputUsed, Data, Len);
+    OutputUsed += Len;
+}
+
+} // namespace
+
+// 溜まった出力を明示的に書き出す
+// 評価結果の表示前と終了時にも呼ばれるため、通常のスクリプトでは呼ばなくても
+// 出力の順序は崩れない
+extern "C" DLLEXPORT double flushd() {
+    std::lock_guard<std::mutex> Guard(OutputLock);
+    flushOutputLocked();
+    fflush(stderr);
+    return 0;
+}
+
 extern "C" DLLEXPORT double putchard(double X) {
-    fputc((char)X, stderr);
+    char C = (char)X;
+    std::lock_guard<std::mutex> Guard(OutputLock);
+    appendOutputLocked(&C, 1);
     return 0;
 }
 
 extern "C" DLLEXPORT double printd(double X) {
-    fprintf(stderr, "%f\n", X);
+    char Buf[32];
+    int Len = snprintf(Buf, sizeof(Buf), "%f\n", X);
+    std::lock_guard<std::mutex> Guard(OutputLock);
+    appendOutputLocked(Buf, (size_t)Len);
+    return 0;
+}
+
+// 一括出力版。ロックとフォーマットの固定費を値ごとではなく呼び出しごとに払う
+// Kaleidoscopeからは配列引数で宣言して使う(例: extern printd_array(a[] n);)
+extern "C" DLLEXPORT double putchard_array(double *A, double N) {
+    std::lock_guard<std::mutex> Guard(OutputLock);
+    for (int64_t i = 0, e = (int64_t)N; i < e; ++i) {
+        char C = (char)A[i];
+        appendOutputLocked(&C, 1);
+    }
+    return 0;
+}
+
+extern "C" DLLEXPORT double printd_array(double *A, double N) {
+    std::lock_guard<std::mutex> Guard(OutputLock);
+    for (int64_t i = 0, e = (int64_t)N; i < e; ++i) {
+        char Buf[32];
+        int Len = snprintf(Buf, sizeof(Buf), "%f\n", A[i]);
+        appendOutputLocked(Buf, (size_t)Len);
+    }
+    return 0;
+}
+
+// 階層型JITのフック。実行回数がしきい値に達した関数がJITコードから呼ぶ
+// (再コンパイル自体はメインスレッドがMainLoopの合間に行う)
+extern "C" DLLEXPORT void kaleidoscope_mark_hot(const char *Name) {
+    std::lock_guard<std::mutex> Guard(HotMutex);
+    PendingHotNames.emplace_back(Name);
+}
+
+// parallel_forランタイム
+// 初回使用時にハードウェア並列度ぶんのワーカースレッドを起動して常駐させ、
+// [Begin, End)の整数添字をチャンクに分けてプール全体へ分配する
+// 呼び出し元スレッドもチャンクを取りに行くので、1コア環境でもそのまま動く
+namespace {
+
+// プールのワーカー内かどうか(ネストしたparallel_forは直列にフォールバックする)
+thread_local bool InPoolWorker = false;
+
+class WorkerPool {
+    // 1回のparallel_for呼び出しぶんの仕事
+    struct Job {
+        void (*Body)(double *, double) = nullptr;
+        double *Data = nullptr;
+        double Begin = 0;
+        int64_t Total = 0;
+        unsigned Chunks = 0;
+    };
+
+    std::vector<std::thread> Workers;
+    std::mutex Lock;
+    std::condition_variable WorkReady;
+    std::condition_variable WorkDone;
+    Job CurrentJob;
+    // 次に取られるチャンク番号(Chunksに達したら仕事なし)
+    unsigned NextChunk = 0;
+    // 未完了のチャンク数(0になったらジョブ完了)
+    unsigned Remaining = 0;
+    bool ShuttingDown = false;
+
+    static void runChunk(const Job &J, unsigned Chunk) {
+        int64_t Lo = J.Total * Chunk / J.Chunks;
+        int64_t Hi = J.Total * (Chunk + 1) / J.Chunks;
+        for (int64_t I = Lo; I != Hi; ++I)
+            J.Body(J.Data, J.Begin + (double)I);
+    }
+
+    void workerMain() {
+        InPoolWorker = true;
+        std::unique_lock<std::mutex> Guard(Lock);
+        while (true) {
+            WorkReady.wait(Guard, [&] { return ShuttingDown || NextChunk < CurrentJob.Chunks; });
+            if (ShuttingDown)
+                return;
+            unsigned Chunk = NextChunk++;
+            Guard.unlock();
+            runChunk(CurrentJob, Chunk);
+            Guard.lock();
+            if (--Remaining == 0)
+                WorkDone.notify_all();
+        }
+    }
+
+    WorkerPool() {
+        unsigned HW = std::thread::hardware_concurrency();
+        // 呼び出し元スレッドも働くため、ワーカーはコア数-1で足りる
+        for (unsigned i = 1; i < HW; ++i)
+            Workers.emplace_back([this] { workerMain(); });
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            ShuttingDown = true;
+        }
+        WorkReady.notify_all();
+        for (std::thread &W: Workers)
+            W.join();
+    }
+
+public:
+    static WorkerPool &get() {
+        static WorkerPool Pool;
+        return Pool;
+    }
+
+    void run(void (*Body)(double *, double), double *Data, double Begin, double End) {
+        int64_t Total = (int64_t)(End - Begin);
+        if (Total <= 0)
+            return;
+        // ワーカー内からの再入(ネストしたparallel_for)はその場で直列実行する
+        if (InPoolWorker || Workers.empty()) {
+            for (int64_t I = 0; I != Total; ++I)
+                Body(Data, Begin + (double)I);
+            return;
+        }
+
+        std::unique_lock<std::mutex> Guard(Lock);
+        // チャンクはスレッド数より多めに切り、遅いチャンクの待ちを減らす
+        unsigned Threads = (unsigned)Workers.size() + 1;
+        unsigned Chunks = (unsigned)std::min<int64_t>(Total, (int64_t)Threads * 4);
+        CurrentJob = {Body, Data, Begin, Total, Chunks};
+        NextChunk = 0;
+        Remaining = Chunks;
+        Guard.unlock();
+        WorkReady.notify_all();
+
+        // 呼び出し元スレッドもチャンクを処理する
+        Guard.lock();
+        while (NextChunk < Chunks) {
+            unsigned Chunk = NextChunk++;
+            Guard.unlock();
+            runChunk(CurrentJob, Chunk);
+            Guard.lock();
+            if (--Remaining == 0)
+                WorkDone.notify_all();
+        }
+        WorkDone.wait(Guard, [&] { return Remaining == 0; });
+    }
+};
+
+} // namespace
+
+// parallel_for組み込みが呼ぶランタイムエントリ
+// Bodyは必ずC規約のラッパー(__pfor.*)で、(データ配列, 添字)を受け取る
+extern "C" DLLEXPORT double kaleidoscope_parallel_for(void (*Body)(double *, double),
+                                                      double *Data, double Begin, double End) {
+    WorkerPool::get().run(Body, Data, Begin, End);
     return 0;
 }
 
 //===----------------------------------------------------------------------===//
-// Main driver code.
+// Benchmark mode
 //===----------------------------------------------------------------------===//
 
-int main(int argc, char *argv[]) {
-    InitializeNativeTarget();
-    InitializeNativeTargetAsmPrinter();
-    InitializeNativeTargetAsmParser();
+// -benchで起動するコンパイラ自身のベンチマーク
+// 合成入力と指定されたソースファイルについて、フェーズごと(lex/parse/codegen+
+// 関数パス/モジュール最適化)の時間とスループットを繰り返し測定して報告する
 
-    BinaryOperatorPrecedence['='] = 2;
-    BinaryOperatorPrecedence['<'] = 10;
-    BinaryOperatorPrecedence['+'] = 20;
-    BinaryOperatorPrecedence['-'] = 20;
-    BinaryOperatorPrecedence['*'] = 40;
+using BenchClock = std::chrono::steady_clock;
 
-    fprintf(stderr, "ready> ");
-    getNextToken();
+static double ElapsedMs(BenchClock::time_point Start, BenchClock::time_point End) {
+    return std::chrono::duration<double, std::milli>(End - Start).count();
+}
 
-    // TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+// 外れ値に引っ張られないよう、繰り返しの中央値を採用する
+static double MedianMs(std::vector<double> &Times) {
+    std::sort(Times.begin(), Times.end());
+    return Times[Times.size() / 2];
+}
 
-    InitializeModuleAndPassManager();
+// NumFunctions個の関数定義からなる合成ソースを生成する
+// 変数・ループ・代入・比較・呼び出しを含み、各フェーズにまんべんなく負荷がかかる
+static std::string MakeSyntheticSource(unsigned NumFunctions) {
+    std::string Source;
+    Source.reserve((size_t)NumFunctions * 128);
+    char Buf[256];
+    for (unsigned i = 0; i < NumFunctions; ++i) {
+        snprintf(Buf, sizeof(Buf),
+                 "def bench%u(a b c) var s = a * %u.0 in"
+                 " (for i = 1.0, i < b, 1.0 in s = s + a * c - i) + s;\n",
+                 i, i + 1);
+        Source += Buf;
+    }
+    // 生成した関数を呼ぶトップレベル式も混ぜる
+    snprintf(Buf, sizeof(Buf), "bench0(1.0, 10.0, 2.0);\n");
+    Source += Buf;
+    return Source;
+}
 
-    MainLoop();
+// ファイル全体を文字列として読み込む(ベンチマークは同じ入力を繰り返し使う)
+static bool ReadSourceFile(const char *Path, std::string &Out) {
+    FILE *In = fopen(Path, "rb");
+    if (!In) {
+        fprintf(stderr, "Error: cannot open '%s'\n", Path);
+        return false;
+    }
+    char Chunk[1 << 16];
+    size_t N;
+    while ((N = fread(Chunk, 1, sizeof(Chunk), In)) > 0)
+        Out.append(Chunk, N);
+    fclose(In);
+    return true;
+}
 
-    InitializeAllTargetInfos();
-    InitializeAllTargets();
-    InitializeAllTargetMCs();
-    InitializeAllAsmParsers();
-    InitializeAllAsmPrinters();
+// 1つの入力ソースについて全フェーズをReps回ずつ測定して結果を出力する
+static void BenchmarkSource(const char *Name, const std::string &Source) {
+    constexpr int Reps = 5;
+
+    // lex: トークンを数えながらEOFまで読み切る
+    std::vector<double> LexTimes;
+    size_t NumTokens = 0;
+    for (int R = 0; R < Reps; ++R) {
+        Lexer Lex;
+        Lex.setSource(Source);
+        size_t Count = 0;
+        auto Start = BenchClock::now();
+        while (Lex.getToken() != token_eof)
+            ++Count;
+        LexTimes.push_back(ElapsedMs(Start, BenchClock::now()));
+        NumTokens = Count;
+    }
 
+    // parse: ASTを構築して捨てる(コード生成なし)
+    std::vector<double> ParseTimes;
+    size_t NumItems = 0;
+    for (int R = 0; R < Reps; ++R) {
+        ASTArena Arena;
+        Parser P(Arena);
+        P.lexer().setSource(Source);
+        size_t Count = 0;
+        auto Start = BenchClock::now();
+        P.parseItems([&Count](Parser::Item Item) { ++Count; });
+        ParseTimes.push_back(ElapsedMs(Start, BenchClock::now()));
+        NumItems = Count;
+        Arena.reset();
+    }
+
+    // codegen: IR生成と関数単位パス、続けてモジュール全体の最適化を測る
+    std::vector<double> CodegenTimes, OptTimes;
+    for (int R = 0; R < Reps; ++R) {
+        InitializeModuleAndPassManager();
+        FunctionProtos.clear();
+        ASTArena Arena;
+        Parser P(Arena);
+        P.lexer().setSource(Source);
+        std::vector<Parser::Item> Items;
+        P.parseItems([&Items](Parser::Item Item) { Items.push_back(std::move(Item)); });
+
+        auto Start = BenchClock::now();
+        for (auto &Item: Items)
+            CodegenParsedItem(Item);
+        CodegenTimes.push_back(ElapsedMs(Start, BenchClock::now()));
+
+        Start = BenchClock::now();
+        OptimizeModule();
+        OptTimes.push_back(ElapsedMs(Start, BenchClock::now()));
+
+        Arena.reset();
+        TheASTArena.reset();
+    }
+
+    double LexMs = MedianMs(LexTimes);
+    double ParseMs = MedianMs(ParseTimes);
+    double CodegenMs = MedianMs(CodegenTimes);
+    double OptMs = MedianMs(OptTimes);
+    fprintf(stderr, "--- %s (%zu bytes, %zu tokens, %zu top-level items, median of %d) ---\n",
+            Name, Source.size(), NumTokens, NumItems, Reps);
+    fprintf(stderr, "  lex       %8.3f ms  (%.1fM tokens/sec)\n",
+            LexMs, LexMs > 0 ? NumTokens / LexMs / 1000.0 : 0.0);
+    fprintf(stderr, "  parse     %8.3f ms  (%.1fK items/sec)\n",
+            ParseMs, ParseMs > 0 ? NumItems / ParseMs : 0.0);
+    fprintf(stderr, "  codegen   %8.3f ms  (%.1fK items/sec, incl. per-function passes)\n",
+            CodegenMs, CodegenMs > 0 ? NumItems / CodegenMs : 0.0);
+    fprintf(stderr, "  moduleopt %8.3f ms\n", OptMs);
+}
+
+// -stats指定時: 収集したカウンタを終了時に一覧出力する
+static void DumpStatsIfEnabled() {
+    if (!StatsEnabled)
+        return;
+    static const char *KindNames[9] = {
+        "NumberExprAST", "VariableExprAST", "BinaryExprAST", "UnaryExprAST",
+        "CallExprAST", "IfExprAST", "ForExprAST", "VarExprAST", "IndexExprAST",
+    };
+    uint64_t TotalNodes = 0;
+    for (const auto &N: TheStats.ASTNodes)
+        TotalNodes += N.load();
+    fprintf(stderr, "=== compilation statistics ===\n");
+    fprintf(stderr, "tokens lexed           : %llu\n", (unsigned long long)TheStats.TokensLexed.load());
+    fprintf(stderr, "AST nodes              : %llu\n", (unsigned long long)TotalNodes);
+    for (int i = 0; i < 9; ++i)
+        fprintf(stderr, "  %-21s: %llu\n", KindNames[i], (unsigned long long)TheStats.ASTNodes[i].load());
+    fprintf(stderr, "functions compiled     : %llu\n", (unsigned long long)TheStats.FunctionsCompiled.load());
+    fprintf(stderr, "IR instructions emitted: %llu\n", (unsigned long long)TheStats.IRInstructions.load());
+    fprintf(stderr, "IR basic blocks        : %llu\n", (unsigned long long)TheStats.IRBasicBlocks.load());
+    fprintf(stderr, "getFunction lookups    : %llu\n", (unsigned long long)TheStats.FunctionLookups.load());
+}
+
+// -time-trace指定時: 収集したイベントをChromeトレース形式のJSONへ書き出す
+// (chrome://tracingやPerfettoでフレームグラフとして開ける)
+static void WriteTimeTraceIfEnabled() {
+    if (!TimeTraceEnabled)
+        return;
+    if (auto Err = timeTraceProfilerWrite(TimeTraceFile, "-"))
+        errs() << "Error writing time trace: " << toString(std::move(Err)) << "\n";
+    else
+        fprintf(stderr, "Wrote %s\n", TimeTraceFile);
+    timeTraceProfilerCleanup();
+}
+
+// ピークRSS(MiB)。Linuxのru_maxrssはKiB単位
+static double PeakRSSMiB() {
+#ifndef _WIN32
+    struct rusage RU;
+    getrusage(RUSAGE_SELF, &RU);
+    return RU.ru_maxrss / 1024.0;
+#else
+    return 0.0;
+#endif
+}
+
+// 合成入力(サイズ違い)と引数で渡されたファイルを順に測定する
+static int RunBenchmarks(const std::vector<const char *> &InputFiles) {
+    for (unsigned N: {100u, 1000u, 10000u}) {
+        char Name[64];
+        snprintf(Name, sizeof(Name), "synthetic-%u", N);
+        BenchmarkSource(Name, MakeSyntheticSource(N));
+    }
+    for (const char *Path: InputFiles) {
+        std::string Source;
+        if (!ReadSourceFile(Path, Source))
+            return 1;
+        BenchmarkSource(Path, Source);
+    }
+    fprintf(stderr, "peak RSS: %.1f MiB\n", PeakRSSMiB());
+    return 0;
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+
+// ホストCPUの名前と機能を検出してTargetMachineを作成する
+// "generic"のままだとSkylake/Zen等のAVX/FMAが一切使われない
+static TargetMachine *CreateHostTargetMachine() {
     auto TargetTriple = sys::getDefaultTargetTriple();
-    TheModule->setTargetTriple(TargetTriple);
 
     std::string Error;
     auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
-
     if (!Target) {
         errs() << Error;
-        return 1;
+        return nullptr;
     }
 
-    auto CPU = "generic";
-    auto Features = "";
+    auto CPU = sys::getHostCPUName();
+
+    // 検出できた機能を"+avx2,+fma,..."形式に連結する
+    std::string Features;
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures)) {
+        for (auto &F: HostFeatures) {
+            if (!Features.empty())
+                Features += ",";
+            Features += (F.second ? "+" : "-") + F.first().str();
+        }
+    }
 
     TargetOptions opt;
     auto RM = Optional<Reloc::Model>();
-    auto TheTargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+    return Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+}
+
+int main(int argc, char *argv[]) {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
 
-    TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    // コマンドライン引数の処理(-O0/-O1/-O2/-O3、-jit、-bench、-o、入力ファイル)
+    std::vector<const char *> InputFiles;
+    bool RunBench = false;
+    const char *OutputFilename = "output.o";
+    const char *PreludeFile = nullptr;
+    const char *EmitPreludeFile = nullptr;
+    unsigned ParallelEmitParts = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view Arg = argv[i];
+        if (Arg == "-O0")
+            OptLevel = OptimizationLevel::O0;
+        else if (Arg == "-O1")
+            OptLevel = OptimizationLevel::O1;
+        else if (Arg == "-O2")
+            OptLevel = OptimizationLevel::O2;
+        else if (Arg == "-O3")
+            OptLevel = OptimizationLevel::O3;
+        else if (Arg == "-jit")
+            UseJIT = true;
+        else if (Arg == "-bench")
+            RunBench = true;
+        else if (Arg == "-stats")
+            StatsEnabled = true;
+        else if (Arg == "-time-trace")
+            TimeTraceEnabled = true;
+        else if (Arg.rfind("-time-trace=", 0) == 0) {
+            TimeTraceEnabled = true;
+            TimeTraceFile = argv[i] + strlen("-time-trace=");
+        }
+        else if (Arg.rfind("-prelude=", 0) == 0)
+            PreludeFile = argv[i] + strlen("-prelude=");
+        else if (Arg.rfind("-emit-prelude=", 0) == 0)
+            EmitPreludeFile = argv[i] + strlen("-emit-prelude=");
+        else if (Arg == "-parallel-emit")
+            ParallelEmitParts = std::max(1u, std::thread::hardware_concurrency());
+        else if (Arg.rfind("-parallel-emit=", 0) == 0)
+            ParallelEmitParts = (unsigned)std::max(1, atoi(argv[i] + strlen("-parallel-emit=")));
+        else if (Arg == "-ast-cache")
+            ASTCacheEnabled = true;
+        else if (Arg == "-obj-cache")
+            TheObjectCache = std::make_unique<orc::KaleidoscopeObjectCache>(".kaleidoscope-cache");
+        else if (Arg == "-o" && i + 1 < argc)
+            OutputFilename = argv[++i];
+        else if (!Arg.empty() && Arg[0] != '-')
+            InputFiles.push_back(argv[i]);
+        else
+            fprintf(stderr, "Warning: unknown argument '%s' ignored\n", argv[i]);
+    }
+
+    // 粒度0(すべてのイベントを記録)でメインスレッドのプロファイラを初期化する
+    if (TimeTraceEnabled)
+        timeTraceProfilerInitialize(0, "kaleidoscope");
+
+    TheTargetMachine = CreateHostTargetMachine();
+    if (!TheTargetMachine)
+        return 1;
+
+    if (RunBench) {
+        // ベンチマークはコンパイルの計測だけを行い、オブジェクトは出力しない
+        Interactive = false;
+        int Result = RunBenchmarks(InputFiles);
+        // 計測中もカウンタとプロファイラは生きているので、他の終了パスと同様に出力する
+        DumpStatsIfEnabled();
+        WriteTimeTraceIfEnabled();
+        return Result;
+    }
+
+    if (UseJIT)
+        TheJIT = ExitOnErr(orc::KaleidoscopeJIT::Create(TheObjectCache.get()));
+
+    if (!InputFiles.empty() && !UseJIT) {
+        // バッチモード: 各ファイルを専用のParserで別スレッドにて並列パースし、
+        // 出来上がったASTをファイル順に1つのモジュールへコード生成する
+        // (パーサーは再入可能だがLLVMContextはスレッド安全ではないため、IR生成は1スレッドで行う)
+        Interactive = false;
+        InitializeModuleAndPassManager();
+
+        // プレリュードはパーサーを作る前に読み込む(演算子優先順位の登録のため)
+        if (PreludeFile && !LoadPrelude(PreludeFile))
+            return 1;
+
+        // パースとコード生成をパイプライン化する: パーサースレッドは項目を
+        // 有界キューへ流し、メインスレッドはパース完了を待たずに先頭から
+        // コード生成を進める(I/O・文字列処理とIR生成・最適化が重なり合う)
+        struct FileUnit {
+            ASTArena Arena;
+            ItemQueue Queue;
+            bool LoadFailed = false;
+        };
+        std::deque<FileUnit> Units(InputFiles.size());
+        std::vector<std::thread> Workers;
+        for (size_t i = 0; i < InputFiles.size(); ++i) {
+            Workers.emplace_back([&Units, &InputFiles, i] {
+                // タイムトレースはスレッドごとに登録する(終了時にまとめられる)
+                if (TimeTraceEnabled)
+                    timeTraceProfilerInitialize(0, "kaleidoscope-parser");
+                {
+                    TimeTraceScope TimeScope("parse file", InputFiles[i]);
+                    auto Sink = [&Units, i](Parser::Item Item) {
+                        Units[i].Queue.push(std::move(Item));
+                    };
+                    if (ASTCacheEnabled) {
+                        // 内容ハッシュが一致すればパースを丸ごと飛ばしてASTを復元する
+                        auto BufOrErr = MemoryBuffer::getFile(InputFiles[i]);
+                        if (!BufOrErr) {
+                            fprintf(stderr, "Error: cannot open '%s'\n", InputFiles[i]);
+                            Units[i].LoadFailed = true;
+                        } else {
+                            MD5 Hash;
+                            Hash.update((*BufOrErr)->getBuffer());
+                            MD5::MD5Result Digest;
+                            Hash.final(Digest);
+                            std::string CachePath = std::string(InputFiles[i]) + ".astc";
+                            if (!LoadCachedAST(CachePath, Digest, Units[i].Arena, Sink)) {
+                                // ミス時は通常どおりパースし、項目を流しつつ直列化して
+                                // キャッシュを書き直す(エラーのあったファイルは除く)
+                                unsigned ErrorsBefore = ErrorsReported.load();
+                                Parser P(Units[i].Arena);
+                                P.lexer().setSource((*BufOrErr)->getBuffer().str());
+                                ASTWriter Writer;
+                                P.parseItems([&Sink, &Writer](Parser::Item Item) {
+                                    Writer.item(Item);
+                                    Sink(std::move(Item));
+                                });
+                                if (ErrorsReported.load() == ErrorsBefore)
+                                    Writer.writeFile(CachePath, Digest);
+                            }
+                        }
+                    } else {
+                        Parser P(Units[i].Arena);
+                        if (P.lexer().loadFile(InputFiles[i]))
+                            P.parseItems(Sink);
+                        else
+                            Units[i].LoadFailed = true;
+                    }
+                }
+                Units[i].Queue.close();
+                if (TimeTraceEnabled)
+                    timeTraceProfilerFinishThread();
+            });
+        }
+
+        bool Failed = false;
+        for (auto &Unit: Units) {
+            Parser::Item Item;
+            while (Unit.Queue.pop(Item))
+                CodegenParsedItem(Item);
+            // キューが閉じた時点でこのファイルのパーサースレッドは終了している
+            Failed |= Unit.LoadFailed;
+            Unit.Arena.reset();
+            // 定数畳み込みが作る置き換えノードはグローバルのアリーナに入る
+            TheASTArena.reset();
+        }
+        for (auto &W: Workers)
+            W.join();
+        // スクリプトからの利用では終了コードが契約なので、構文エラーや
+        // コード生成エラーが1件でもあればオブジェクトを書かずに失敗させる
+        if (ErrorsReported.load() != 0) {
+            fprintf(stderr, "%u error(s), no output written\n", ErrorsReported.load());
+            Failed = true;
+        }
+        if (Failed)
+            return 1;
+    } else {
+        InitializeModuleAndPassManager();
+
+        // プレリュードはパーサーを作る前に読み込む(演算子優先順位の登録のため)
+        if (PreludeFile && !LoadPrelude(PreludeFile))
+            return 1;
+
+        // 対話/パイプ入力は1つのParserで逐次処理する
+        Parser TheParser(TheASTArena);
+
+        if (!InputFiles.empty()) {
+            // -jitとファイル指定の併用: 各ファイルを順に連結し、REPLと同じ
+            // 逐次評価パスでJIT実行する(バッチの並列パースは1モジュールへの
+            // AOT出力用で、式を出現順に実行するJITとは相容れない)
+            std::string Source;
+            for (const char *Path: InputFiles) {
+                auto BufOrErr = MemoryBuffer::getFile(Path);
+                if (!BufOrErr) {
+                    fprintf(stderr, "Error: cannot open '%s'\n", Path);
+                    return 1;
+                }
+                StringRef Contents = (*BufOrErr)->getBuffer();
+                Source.append(Contents.data(), Contents.size());
+                Source += '\n';
+            }
+            TheParser.lexer().setSource(std::move(Source));
+            Interactive = false;
+        }
+        // パイプやリダイレクト経由の入力は一括読み込みしてバッファモードでレキシングする
+#ifndef _WIN32
+        else if (!isatty(fileno(stdin))) {
+            TheParser.lexer().slurp(stdin);
+            Interactive = false;
+        }
+#endif
+
+        if (Interactive)
+            fprintf(stderr, "ready> ");
+        TheParser.getNextToken();
+
+        MainLoop(TheParser);
+    }
+
+    // JITモードでは逐次実行が目的なのでオブジェクト出力は行わない
+    if (UseJIT) {
+        flushd();
+        DumpStatsIfEnabled();
+        WriteTimeTraceIfEnabled();
+        return 0;
+    }
+
+    // -emit-prelude=ではオブジェクトの代わりに最適化済みビットコードを出力する
+    // プレリュードはライブラリなので、無名のトップレベル式は落として定義だけ残す
+    if (EmitPreludeFile) {
+        for (auto It = TheModule->begin(); It != TheModule->end();) {
+            Function &F = *It++;
+            if (F.getName().startswith("__anon_expr"))
+                F.eraseFromParent();
+        }
+        RecordOperatorPrecedences(*TheModule);
+        OptimizeModule();
+
+        std::error_code EC;
+        raw_fd_ostream BCOut(EmitPreludeFile, EC, sys::fs::OF_None);
+        if (EC) {
+            errs() << "Could not open file: " << EC.message();
+            return 1;
+        }
+        {
+            TimeTraceScope TimeScope("emit prelude", EmitPreludeFile);
+            WriteBitcodeToFile(*TheModule, BCOut);
+        }
+        outs() << "Wrote " << EmitPreludeFile << "\n";
+        DumpStatsIfEnabled();
+        WriteTimeTraceIfEnabled();
+        return 0;
+    }
+
+    // モジュール全体の最適化(ベクタライザ込み)をかけてからオブジェクトを出力する
+    OptimizeModule();
+
+    // -parallel-emitではモジュールを関数単位のバケツへ分割し、命令選択を
+    // スレッドプールで並列に走らせて部分ごとのオブジェクト(<出力>.<k>)を出力する
+    // TargetMachineもLLVMContextもスレッド安全ではないため、各部分をビットコード
+    // 経由でワーカー専用のコンテキストへ移し、TargetMachineもワーカーごとに作る
+    if (ParallelEmitParts > 1) {
+        std::vector<std::string> PartBitcode;
+        SplitModule(*TheModule, ParallelEmitParts,
+                    [&PartBitcode](std::unique_ptr<Module> Part) {
+                        // 定義を1つも含まない部分は空のオブジェクトになるだけなので捨てる
+                        bool HasDefinition = false;
+                        for (const Function &F: *Part)
+                            HasDefinition |= !F.isDeclaration();
+                        for (const GlobalVariable &G: Part->globals())
+                            HasDefinition |= G.hasInitializer();
+                        if (!HasDefinition)
+                            return;
+                        std::string BC;
+                        raw_string_ostream OS(BC);
+                        WriteBitcodeToFile(*Part, OS);
+                        PartBitcode.push_back(std::move(OS.str()));
+                    });
+
+        std::atomic<bool> EmitFailed{false};
+        std::vector<std::thread> Emitters;
+        for (size_t K = 0; K < PartBitcode.size(); ++K) {
+            Emitters.emplace_back([&PartBitcode, &EmitFailed, OutputFilename, K] {
+                if (TimeTraceEnabled)
+                    timeTraceProfilerInitialize(0, "kaleidoscope-emit");
+                {
+                    std::string PartName =
+                            std::string(OutputFilename) + "." + std::to_string(K);
+                    TimeTraceScope TimeScope("emit object", PartName);
+                    LLVMContext Ctx;
+                    auto PartOrErr = parseBitcodeFile(
+                            MemoryBufferRef(PartBitcode[K], PartName), Ctx);
+                    std::unique_ptr<TargetMachine> TM(CreateHostTargetMachine());
+                    std::error_code EC;
+                    raw_fd_ostream Dest(PartName, EC, sys::fs::OF_None);
+                    legacy::PassManager Pass;
+                    if (!PartOrErr || !TM || EC ||
+                        TM->addPassesToEmitFile(Pass, Dest, nullptr, CGFT_ObjectFile)) {
+                        if (!PartOrErr)
+                            consumeError(PartOrErr.takeError());
+                        errs() << "Could not emit " << PartName << "\n";
+                        EmitFailed = true;
+                    } else {
+                        Pass.run(**PartOrErr);
+                        Dest.flush();
+                    }
+                }
+                if (TimeTraceEnabled)
+                    timeTraceProfilerFinishThread();
+            });
+        }
+        for (auto &T: Emitters)
+            T.join();
+        if (EmitFailed)
+            return 1;
+        // より多くの部分を出していた前回の実行の残骸を消す(READMEの
+        // 「output.o.*をすべてリンクする」手順が古いオブジェクトを拾わないように)
+        for (size_t K = PartBitcode.size();; ++K) {
+            std::string Stale = std::string(OutputFilename) + "." + std::to_string(K);
+            if (!sys::fs::exists(Stale))
+                break;
+            sys::fs::remove(Stale);
+        }
+        for (size_t K = 0; K < PartBitcode.size(); ++K)
+            outs() << "Wrote " << OutputFilename << "." << K << "\n";
+
+        DumpStatsIfEnabled();
+        WriteTimeTraceIfEnabled();
+        return 0;
+    }
 
-    auto Filename = "output.o";
     std::error_code EC;
-    raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+    raw_fd_ostream dest(OutputFilename, EC, sys::fs::OF_None);
 
     if (EC) {
         errs() << "Could not open file: " << EC.message();
@@ -1186,10 +3944,16 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    pass.run(*TheModule);
-    dest.flush();
+    {
+        TimeTraceScope TimeScope("emit object", OutputFilename);
+        pass.run(*TheModule);
+        dest.flush();
+    }
+
+    outs() << "Wrote " << OutputFilename << "\n";
 
-    outs() << "Wrote " << Filename << "\n";
+    DumpStatsIfEnabled();
+    WriteTimeTraceIfEnabled();
 
     // TheModule->print(errs(), nullptr);
 